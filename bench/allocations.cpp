@@ -0,0 +1,224 @@
+#include <flow/engine.h>
+#include <flow/signal.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <thread>
+
+
+// Counts heap allocations per message on the engine dispatch paths, by
+// replacing the global operator new. Each path is compared with a baseline
+// which queues the same callback as the engine did before callbacks were
+// stored as a flow::Task: a std::function copied into and out of a
+// mutex-guarded std::queue (a std::deque).
+
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+// Runs the engine with one poll callback, which writes count messages
+// through the given function once warmed up and then waits for them
+// all to be received.
+template <typename Write>
+double measure(flow::Engine& engine, std::atomic<size_t>& received, size_t count, const Write& write)
+{
+    double result = 0;
+    engine.create_poll_callback([&]() {
+        for (size_t i = 0; i < count; i++) write();
+        while (received < count) std::this_thread::yield();
+
+        size_t before = allocations;
+        for (size_t i = 0; i < count; i++) write();
+        while (received < 2 * count) std::this_thread::yield();
+        result = double(allocations - before) / count;
+
+        engine.stop();
+        return false;
+    });
+    engine.run(1);
+    return result;
+}
+
+// The engine's previous callback queue, run by a single worker thread
+class BaselineQueue {
+public:
+    BaselineQueue():
+        running(true),
+        worker([this]() { execute(); })
+    {}
+    ~BaselineQueue()
+    {
+        {
+            std::scoped_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        cv.notify_one();
+        worker.join();
+    }
+
+    void push_callback(const std::function<void()>& callback)
+    {
+        {
+            std::scoped_lock<std::mutex> lock(mutex);
+            queue.push(callback);
+        }
+        cv.notify_one();
+    }
+
+private:
+    void execute()
+    {
+        while (true) {
+            std::function<void()> callback;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return !queue.empty() || !running; });
+                if (queue.empty()) return;
+                callback = queue.front();
+                queue.pop();
+            }
+            callback();
+        }
+    }
+
+    std::queue<std::function<void()>> queue;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool running;
+    std::thread worker;
+};
+
+// As measure(), writing from the calling thread
+template <typename Write>
+double measure_baseline(std::atomic<size_t>& received, size_t count, const Write& write)
+{
+    for (size_t i = 0; i < count; i++) write();
+    while (received < count) std::this_thread::yield();
+
+    size_t before = allocations;
+    for (size_t i = 0; i < count; i++) write();
+    while (received < 2 * count) std::this_thread::yield();
+    return double(allocations - before) / count;
+}
+
+double baseline_push_callback(size_t count)
+{
+    BaselineQueue queue;
+    std::atomic<size_t> received(0);
+    return measure_baseline(received, count, [&]() {
+        queue.push_callback([&received]() { received++; });
+    });
+}
+
+// CallbackInput copied each message into a preallocated ring, which
+// didn't allocate, then pushed its process callback bound to itself,
+// which is too large for std::function's inline buffer
+struct BaselineCallbackInput {
+    void write(int)
+    {
+        queue.push_callback(std::bind(&BaselineCallbackInput::process, this));
+    }
+    void process()
+    {
+        received++;
+    }
+
+    std::atomic<size_t> received = 0;
+    BaselineQueue queue;
+};
+
+double baseline_callback_input(size_t count)
+{
+    BaselineCallbackInput input;
+    return measure_baseline(input.received, count, [&]() {
+        input.write(1);
+    });
+}
+
+// Timers were pushed as a lambda capturing the time and the timer,
+// wrapped in a std::bind
+double baseline_timer(size_t count)
+{
+    BaselineQueue queue;
+    std::atomic<size_t> received(0);
+    std::function<void(flow::TimePoint)> callback = [&received](flow::TimePoint) { received++; };
+    return measure_baseline(received, count, [&]() {
+        flow::TimePoint time = {0, 0, 1};
+        queue.push_callback(std::bind([time, &callback]() {
+            callback(time);
+        }));
+    });
+}
+
+double push_callback(size_t count)
+{
+    flow::Engine engine;
+    std::atomic<size_t> received(0);
+    return measure(engine, received, count, [&]() {
+        engine.push_callback([&received]() { received++; });
+    });
+}
+
+double callback_input(size_t count)
+{
+    flow::Engine engine;
+    std::atomic<size_t> received(0);
+    flow::DirectOutput<int> out;
+    flow::CallbackInput<int> in(engine, [&](const int&) { received++; }, 1 << 17);
+    flow::connect(out, in);
+    return measure(engine, received, count, [&]() {
+        out.write(1);
+    });
+}
+
+double timer(double duration)
+{
+    flow::Engine engine;
+    std::atomic<size_t> fired(0);
+    size_t before = 0;
+    engine.create_timer_callback(1e-4, [&](flow::TimePoint) {
+        if (fired++ == 100) before = allocations;
+    });
+    engine.create_timer_callback(duration, [&](flow::TimePoint time) {
+        if (time.time >= duration) engine.stop();
+    });
+    engine.run(1);
+    return double(allocations - before) / (fired - 100);
+}
+
+int main()
+{
+    auto row = [](const char* name, double before, double after) {
+        std::cout << std::left << std::setw(16) << name
+            << std::setw(10) << before << after << std::endl;
+    };
+    std::cout << "Allocations per callback" << std::endl;
+    std::cout << std::left << std::setw(16) << "" << std::setw(10) << "before" << "after" << std::endl;
+    row("push_callback", baseline_push_callback(100000), push_callback(100000));
+    row("callback_input", baseline_callback_input(100000), callback_input(100000));
+    row("timer", baseline_timer(100000), timer(0.5));
+    return 0;
+}
@@ -0,0 +1,467 @@
+#include <flow/engine.h>
+#include <flow/signal.h>
+#include <flow/pipeline.h>
+#include <flow/service.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Benchmarks for the engine dispatch paths. Results are written as JSON,
+// to stdout or to the file given as the first argument, eg:
+// {"benchmarks": [{"name": "queue_throughput", "scheduler": "fifo", "threads": 4, "callbacks_per_second": ...}, ...]}
+
+static int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A benchmark result, as a name followed by a list of fields, where each
+// field is either a string or a number.
+class Result {
+public:
+    Result(const std::string& name)
+    {
+        add("name", name);
+    }
+    Result& add(const std::string& key, const std::string& value)
+    {
+        fields.emplace_back(key, "\"" + value + "\"");
+        return *this;
+    }
+    Result& add(const std::string& key, double value)
+    {
+        std::stringstream ss;
+        ss << std::setprecision(15) << value;
+        fields.emplace_back(key, ss.str());
+        return *this;
+    }
+    std::string json() const
+    {
+        std::string result = "{";
+        for (size_t i = 0; i < fields.size(); i++) {
+            if (i > 0) result += ", ";
+            result += "\"" + fields[i].first + "\": " + fields[i].second;
+        }
+        return result + "}";
+    }
+private:
+    std::vector<std::pair<std::string, std::string>> fields;
+};
+
+static std::vector<Result> results;
+
+// Runs the engine with one poll callback, which runs the benchmark once
+// and then stops the engine.
+template <typename Function>
+void run_once(flow::Engine& engine, size_t num_threads, const Function& function)
+{
+    engine.create_poll_callback([&]() {
+        function();
+        engine.stop();
+        return false;
+    });
+    engine.run(num_threads);
+}
+
+static void wait_for(const std::atomic<size_t>& counter, size_t target)
+{
+    while (counter.load(std::memory_order_acquire) < target) {
+        std::this_thread::yield();
+    }
+}
+
+// Nearest-rank percentile, of sorted samples
+static double percentile(const std::vector<int64_t>& samples, double p)
+{
+    if (samples.empty()) return 0;
+    size_t index = std::min(samples.size() - 1, size_t(p * samples.size()));
+    return samples[index];
+}
+
+static void add_percentiles(Result& result, std::vector<int64_t>& samples)
+{
+    std::sort(samples.begin(), samples.end());
+    result.add("p50_ns", percentile(samples, 0.5));
+    result.add("p90_ns", percentile(samples, 0.9));
+    result.add("p99_ns", percentile(samples, 0.99));
+    result.add("p999_ns", percentile(samples, 0.999));
+    result.add("max_ns", samples.empty() ? 0 : samples.back());
+}
+
+
+// Pushes callbacks from a poll thread as fast as possible and measures
+// how quickly the callback threads get through them.
+void bench_queue_throughput(flow::Scheduler scheduler, size_t num_threads, size_t count, bool instrumentation = false)
+{
+    flow::EngineConfig config;
+    config.scheduler = scheduler;
+    config.instrumentation = instrumentation;
+    flow::Engine engine(config);
+    std::atomic<size_t> executed(0);
+    double elapsed = 0;
+
+    run_once(engine, num_threads, [&]() {
+        int64_t start = now_ns();
+        for (size_t i = 0; i < count; i++) {
+            engine.push_callback([&executed]() {
+                executed.fetch_add(1, std::memory_order_release);
+            });
+        }
+        wait_for(executed, count);
+        elapsed = 1e-9 * (now_ns() - start);
+    });
+
+    results.push_back(Result("queue_throughput")
+        .add("scheduler", scheduler == flow::Scheduler::Fifo ? "fifo" : "work_stealing")
+        .add("threads", num_threads)
+        .add("instrumentation", instrumentation ? "on" : "off")
+        .add("callbacks", count)
+        .add("callbacks_per_second", count / elapsed));
+}
+
+// Runs chains of callbacks, where each callback pushes the next one in its
+// chain from the callback thread, as when a component's callback triggers
+// another. There are several chains per thread, so all threads stay busy.
+void bench_worker_throughput(flow::Scheduler scheduler, size_t num_threads, size_t count)
+{
+    flow::EngineConfig config;
+    config.scheduler = scheduler;
+    flow::Engine engine(config);
+    std::atomic<size_t> executed(0);
+    double elapsed = 0;
+
+    const size_t num_chains = 4 * num_threads;
+    const size_t length = count / num_chains;
+    std::function<void(size_t)> step = [&](size_t remaining) {
+        executed.fetch_add(1, std::memory_order_release);
+        if (remaining > 1) {
+            engine.push_callback([&step, remaining]() { step(remaining - 1); });
+        }
+    };
+
+    run_once(engine, num_threads, [&]() {
+        int64_t start = now_ns();
+        for (size_t i = 0; i < num_chains; i++) {
+            engine.push_callback([&step, length]() { step(length); });
+        }
+        wait_for(executed, num_chains * length);
+        elapsed = 1e-9 * (now_ns() - start);
+    });
+
+    results.push_back(Result("worker_throughput")
+        .add("scheduler", scheduler == flow::Scheduler::Fifo ? "fifo" : "work_stealing")
+        .add("threads", num_threads)
+        .add("callbacks", num_chains * length)
+        .add("callbacks_per_second", num_chains * length / elapsed));
+}
+
+// Writes one message at a time and measures the time from the write until
+// the callback runs.
+void bench_callback_latency(size_t count)
+{
+    flow::Engine engine;
+    std::atomic<size_t> received(0);
+    std::vector<int64_t> latencies;
+    latencies.reserve(count);
+
+    flow::DirectOutput<int64_t> out;
+    flow::CallbackInput<int64_t> in(engine, [&](const int64_t& sent) {
+        latencies.push_back(now_ns() - sent);
+        received.fetch_add(1, std::memory_order_release);
+    });
+    flow::connect(out, in);
+
+    run_once(engine, 4, [&]() {
+        for (size_t i = 0; i < count; i++) {
+            out.write(now_ns());
+            wait_for(received, i + 1);
+        }
+    });
+
+    Result result("callback_latency");
+    result.add("messages", count);
+    add_percentiles(result, latencies);
+    results.push_back(result);
+}
+
+// As above, but for the callback of a SampledInput, which runs on the
+// writing thread.
+void bench_sampled_latency(size_t count)
+{
+    flow::Engine engine;
+    std::vector<int64_t> latencies;
+    latencies.reserve(count);
+
+    flow::DirectOutput<int64_t> out;
+    flow::SampledInput<int64_t> in(engine, [&](const int64_t& sent) {
+        latencies.push_back(now_ns() - sent);
+    });
+    flow::connect(out, in);
+
+    run_once(engine, 1, [&]() {
+        for (size_t i = 0; i < count; i++) {
+            out.write(now_ns());
+        }
+    });
+
+    Result result("sampled_latency");
+    result.add("messages", count);
+    add_percentiles(result, latencies);
+    results.push_back(result);
+}
+
+// Round trip time of ServiceClient::sync_call to a server which returns
+// the request.
+void bench_service_latency(size_t count)
+{
+    flow::Engine engine;
+    std::vector<int64_t> latencies;
+    latencies.reserve(count);
+
+    flow::ServiceClient<int, int> client(engine);
+    flow::ServiceServer<int, int> server(engine, [](const int& request) { return request; });
+    flow::connect(client, server);
+
+    run_once(engine, 4, [&]() {
+        for (size_t i = 0; i < count; i++) {
+            int64_t start = now_ns();
+            client.sync_call(i);
+            latencies.push_back(now_ns() - start);
+        }
+    });
+
+    Result result("service_latency");
+    result.add("calls", count);
+    add_percentiles(result, latencies);
+    results.push_back(result);
+}
+
+// Calls per second through one client with up to in_flight calls
+// outstanding, to a server which returns the request.
+void bench_service_throughput(size_t in_flight, size_t count)
+{
+    flow::Engine engine;
+    flow::ServiceClient<int, int> client(engine);
+    flow::ServiceServer<int, int> server(engine, [](const int& request) { return request; }, in_flight);
+    flow::connect(client, server);
+    double elapsed = 0;
+
+    run_once(engine, 4, [&]() {
+        std::vector<std::future<int>> futures;
+        futures.reserve(in_flight);
+        int64_t start = now_ns();
+        for (size_t i = 0; i < count; i += in_flight) {
+            futures.clear();
+            for (size_t j = i; j < std::min(count, i + in_flight); j++) {
+                futures.push_back(client.call(j));
+            }
+            for (auto& future: futures) {
+                future.get();
+            }
+        }
+        elapsed = 1e-9 * (now_ns() - start);
+    });
+
+    results.push_back(Result("service_throughput")
+        .add("in_flight", in_flight)
+        .add("calls", count)
+        .add("calls_per_second", count / elapsed));
+}
+
+// Writes messages to an output connected to many callback inputs, and
+// measures how quickly they are all delivered.
+void bench_fan_out(size_t num_subscribers, size_t count)
+{
+    flow::Engine engine;
+    std::atomic<size_t> received(0);
+
+    flow::DirectOutput<int> out;
+    std::vector<std::unique_ptr<flow::CallbackInput<int>>> inputs;
+    for (size_t i = 0; i < num_subscribers; i++) {
+        inputs.push_back(std::make_unique<flow::CallbackInput<int>>(
+            engine,
+            [&](const int&) { received.fetch_add(1, std::memory_order_release); },
+            1024
+        ));
+        flow::connect(out, *inputs.back());
+    }
+    double elapsed = 0;
+
+    run_once(engine, 4, [&]() {
+        int64_t start = now_ns();
+        for (size_t i = 0; i < count; i++) {
+            out.write(int(i));
+        }
+        wait_for(received, count * num_subscribers);
+        elapsed = 1e-9 * (now_ns() - start);
+    });
+
+    results.push_back(Result("fan_out")
+        .add("subscribers", num_subscribers)
+        .add("messages", count)
+        .add("messages_per_second", count / elapsed)
+        .add("deliveries_per_second", count * num_subscribers / elapsed));
+}
+
+// Cost per message of passing a large payload to a callback input, when
+// written by reference (copied), by move, or as a shared pointer.
+// The queue holds every message, so writes never wait for the callback.
+void bench_payload(size_t size, const std::string& mode, size_t count)
+{
+    typedef std::vector<uint8_t> payload_t;
+    flow::Engine engine;
+    std::atomic<size_t> received(0);
+
+    flow::DirectOutput<payload_t> out;
+    flow::CallbackInput<payload_t> in(engine, [&](const payload_t&) {
+        received.fetch_add(1, std::memory_order_release);
+    }, count);
+    flow::connect(out, in);
+
+    payload_t payload(size, 1);
+    auto shared = std::make_shared<const payload_t>(payload);
+    double elapsed = 0;
+
+    run_once(engine, 4, [&]() {
+        int64_t start = now_ns();
+        for (size_t i = 0; i < count; i++) {
+            if (mode == "copy") {
+                out.write(payload);
+            } else if (mode == "move") {
+                out.write(payload_t(size, 1));
+            } else {
+                out.write(shared);
+            }
+        }
+        wait_for(received, count);
+        elapsed = 1e-9 * (now_ns() - start);
+    });
+
+    results.push_back(Result("payload")
+        .add("bytes", size)
+        .add("mode", mode)
+        .add("messages", count)
+        .add("ns_per_message", 1e9 * elapsed / count));
+}
+
+// Cost per message of a filter -> controller chain, when connected at
+// runtime through outputs and inputs, when built as a pipeline fed by
+// a runtime output through a static input, and when calling the pipeline
+// directly. Runs on the writing thread, so no engine threads are needed.
+void bench_pipeline(const std::string& mode, size_t count)
+{
+    flow::Engine engine;
+    double total = 0;
+    double filtered = 0;
+    auto filter = [&filtered](double value) {
+        filtered += 0.1 * (value - filtered);
+        return filtered;
+    };
+    auto controller = [](double value) -> std::optional<double> {
+        if (value < 0) return std::nullopt;
+        return 2 * (1 - value);
+    };
+    auto sink = [&total](double command) { total += command; };
+
+    flow::DirectOutput<double> out;
+    flow::DirectOutput<double> out_filter;
+    flow::DirectOutput<double> out_controller;
+    flow::DirectInput<double> in_filter(engine, [&](const double& value) {
+        out_filter.write(filter(value));
+    });
+    flow::DirectInput<double> in_controller(engine, [&](const double& value) {
+        auto command = controller(value);
+        if (command) out_controller.write(*command);
+    });
+    flow::DirectInput<double> in_sink(engine, sink);
+    auto in_static = flow::static_input<double>(filter, controller, sink);
+    auto chain = flow::pipeline(filter, controller, sink);
+
+    if (mode == "runtime") {
+        flow::connect(out, in_filter);
+        flow::connect(out_filter, in_controller);
+        flow::connect(out_controller, in_sink);
+    } else if (mode == "static_input") {
+        flow::connect(out, in_static);
+    }
+
+    int64_t start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        double value = 1e-6 * double(i % 1000);
+        if (mode == "pipeline") {
+            chain(value);
+        } else {
+            out.write(value);
+        }
+    }
+    double elapsed = 1e-9 * (now_ns() - start);
+
+    results.push_back(Result("pipeline")
+        .add("mode", mode)
+        .add("messages", count)
+        .add("ns_per_message", 1e9 * elapsed / count)
+        .add("checksum", total));
+}
+
+int main(int argc, char** argv)
+{
+    for (size_t threads: {1, 2, 4, 8}) {
+        bench_queue_throughput(flow::Scheduler::Fifo, threads, 1000000);
+        bench_queue_throughput(flow::Scheduler::WorkStealing, threads, 1000000);
+    }
+    bench_queue_throughput(flow::Scheduler::Fifo, 4, 1000000, true);
+    bench_queue_throughput(flow::Scheduler::WorkStealing, 4, 1000000, true);
+    for (size_t threads: {1, 2, 4, 8}) {
+        bench_worker_throughput(flow::Scheduler::Fifo, threads, 1000000);
+        bench_worker_throughput(flow::Scheduler::WorkStealing, threads, 1000000);
+    }
+
+    bench_callback_latency(100000);
+    bench_sampled_latency(100000);
+    bench_service_latency(20000);
+    for (size_t in_flight: {1, 8, 64}) {
+        bench_service_throughput(in_flight, 100000);
+    }
+
+    for (size_t subscribers = 1; subscribers <= 64; subscribers *= 2) {
+        bench_fan_out(subscribers, 100000 / subscribers);
+    }
+
+    for (size_t size: {1 << 10, 1 << 16, 1 << 20}) {
+        size_t count = (size_t(1) << 30) / size / 16;
+        for (const char* mode: {"copy", "move", "shared"}) {
+            bench_payload(size, mode, count);
+        }
+    }
+
+    for (const char* mode: {"runtime", "static_input", "pipeline"}) {
+        bench_pipeline(mode, 10000000);
+    }
+
+    std::stringstream json;
+    json << "{\"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        json << "  " << results[i].json() << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "]}\n";
+
+    if (argc > 1) {
+        std::ofstream file(argv[1]);
+        file << json.str();
+    } else {
+        std::cout << json.str();
+    }
+    return 0;
+}
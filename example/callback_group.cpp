@@ -0,0 +1,114 @@
+#include <flow/callback_group.h>
+#include <flow/engine.h>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+
+// Several threads post work to one mutually exclusive callback group at
+// once. The group runs it one callback at a time, so the counts it keeps
+// need no lock, and each thread's work runs in the order it was posted.
+
+
+// Takes a while to move, like a thread being preempted while it posts, so
+// the group often sees a later post finish before an earlier one.
+struct SlowMove {
+    bool slow;
+
+    SlowMove(bool slow): slow(slow) {}
+    SlowMove(SlowMove&& other) noexcept:
+        slow(other.slow)
+    {
+        if (slow) std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    SlowMove& operator=(SlowMove&& other) noexcept
+    {
+        slow = other.slow;
+        if (slow) std::this_thread::sleep_for(std::chrono::microseconds(200));
+        return *this;
+    }
+};
+
+
+// Tally: Counts the work posted by each thread, and checks it arrives in
+// order
+class Tally {
+public:
+    Tally(flow::Engine& engine, size_t num_producers, size_t count):
+        engine(engine),
+        count(count),
+        group(engine, flow::CallbackGroupType::MutuallyExclusive, "tally"),
+        next(num_producers, 0),
+        total(0),
+        out_of_order(0),
+        running(false),
+        overlapped(0)
+    {}
+
+    void post(size_t producer, size_t index)
+    {
+        group.push_callback([this, producer, index, delay = SlowMove(index % 64 == 0)]() {
+            callback_work(producer, index);
+        });
+    }
+
+    bool valid() const
+    {
+        return total == next.size() * count && out_of_order == 0 && overlapped == 0;
+    }
+    void print() const
+    {
+        std::cout << "Ran " << total << " of " << next.size() * count << " callbacks, "
+            << out_of_order << " out of order, " << overlapped << " overlapped" << std::endl;
+    }
+
+private:
+    void callback_work(size_t producer, size_t index)
+    {
+        if (running.exchange(true)) overlapped++;
+        if (index != next[producer]) out_of_order++;
+        next[producer] = index + 1;
+        total++;
+        running = false;
+        if (total == next.size() * count) engine.stop();
+    }
+
+    flow::Engine& engine;
+    const size_t count;
+    flow::CallbackGroup group;
+    std::vector<size_t> next;
+    size_t total;
+    size_t out_of_order;
+    std::atomic<bool> running;
+    std::atomic<size_t> overlapped;
+};
+
+
+int main()
+{
+    const size_t num_producers = 4;
+    const size_t count = 5000;
+
+    flow::Engine engine;
+    Tally tally(engine, num_producers, count);
+
+    std::vector<std::thread> producers;
+    for (size_t producer = 0; producer < num_producers; producer++) {
+        producers.emplace_back([&tally, producer, count]() {
+            for (size_t i = 0; i < count; i++) {
+                tally.post(producer, i);
+                // Lets the group run dry between posts
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+            }
+        });
+    }
+    engine.run();
+    for (auto& producer: producers) {
+        producer.join();
+    }
+
+    tally.print();
+    return tally.valid() ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+#include <flow/coroutine.h>
+#include <flow/engine.h>
+#include <flow/service.h>
+#include <flow/signal.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <thread>
+
+
+// Works through a list of goals in a coroutine, which waits for each goal
+// on an input, asks a planner service for the route, then waits while it
+// "drives" there. Meanwhile another coroutine ticks on a timer. Neither
+// takes a thread while waiting.
+
+struct Goal {
+    int id;
+    double x;
+    double y;
+};
+
+
+// GoalGenerator: Writes goals at a fixed period, until it has written the
+// given number
+// out_goal (Goal): The next goal
+class GoalGenerator {
+public:
+    GoalGenerator(flow::Engine& engine, double period, int count):
+        count(count),
+        next_id(0)
+    {
+        engine.create_timer_callback(period, std::bind(&GoalGenerator::callback_timer, this), "goal_generator");
+    }
+
+    flow::Output<Goal>& out_goal() { return out_goal_; }
+
+private:
+    void callback_timer()
+    {
+        if (next_id == count) return;
+        Goal goal = {next_id, std::cos(next_id), std::sin(next_id)};
+        next_id++;
+        out_goal_.write(goal);
+    }
+
+    const int count;
+    int next_id;
+    flow::DirectOutput<Goal> out_goal_;
+};
+
+
+// Planner: Returns the length of the route to a goal. Some goals take
+// longer to plan than the caller will wait.
+// Times are in wall-clock seconds, with wide margins either side of the
+// caller's timeout, so the same goals time out on a loaded machine.
+// Service (Goal -> double)
+class Planner {
+public:
+    Planner(flow::Engine& engine, int slow_goal):
+        slow_goal(slow_goal),
+        server(engine, std::bind(&Planner::callback_plan, this, std::placeholders::_1))
+    {}
+
+    flow::ServiceServer<Goal, double>& service() { return server; }
+
+private:
+    double callback_plan(const Goal& goal)
+    {
+        if (goal.id == slow_goal) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        }
+        return std::hypot(goal.x, goal.y);
+    }
+
+    const int slow_goal;
+    flow::ServiceServer<Goal, double> server;
+};
+
+
+struct Progress {
+    int reached = 0;
+    int timed_out = 0;
+    int ticks = 0;
+    std::atomic<bool> done = false;
+};
+
+flow::Coroutine execute_goals(
+    flow::Engine& engine,
+    flow::CoroutineInput<Goal>& goals,
+    flow::ServiceClient<Goal, double>& planner,
+    int count,
+    Progress& progress)
+{
+    for (int i = 0; i < count; i++) {
+        Goal goal = co_await goals.next();
+        std::optional<double> length = co_await planner.co_call(goal, 0.2);
+        if (!length) {
+            std::cout << "Goal " << goal.id << ": Planning timed out" << std::endl;
+            progress.timed_out++;
+            // Give the planner time to finish the slow goal, so the next
+            // call isn't queued behind it
+            co_await engine.sleep_for(0.5);
+            continue;
+        }
+        flow::TimePoint start = engine.get_time();
+        flow::TimePoint end = co_await engine.sleep_for(0.01 * *length);
+        std::cout << "Goal " << goal.id << ": Reached after " << end.time - start.time << " s" << std::endl;
+        progress.reached++;
+    }
+    // Let the ticking coroutine see it's done and return, since
+    // coroutines still suspended when the engine stops are never freed
+    progress.done = true;
+    co_await engine.sleep_for(0.01);
+    engine.stop();
+}
+
+flow::Coroutine tick(flow::Engine& engine, double period, Progress& progress)
+{
+    double next = engine.get_time().time;
+    while (!progress.done) {
+        next += period;
+        co_await engine.sleep_until(next);
+        progress.ticks++;
+    }
+}
+
+
+int main()
+{
+    const int count = 6;
+    const int slow_goal = 3;
+
+    flow::Engine engine;
+    GoalGenerator generator(engine, 0.02, count);
+    Planner planner(engine, slow_goal);
+    flow::ServiceClient<Goal, double> client(engine);
+    flow::CoroutineInput<Goal> goals(engine);
+    flow::connect(generator.out_goal(), goals);
+    flow::connect(client, planner.service());
+
+    Progress progress;
+    flow::spawn(engine, execute_goals(engine, goals, client, count, progress));
+    flow::spawn(engine, tick(engine, 0.005, progress));
+    engine.run();
+
+    std::cout << "Reached " << progress.reached << " goals, " << progress.timed_out << " timed out, "
+        << progress.ticks << " ticks" << std::endl;
+    bool valid = progress.reached == count - 1 && progress.timed_out == 1 && progress.ticks > 0;
+    return valid ? 0 : 1;
+}
@@ -37,7 +37,8 @@ public:
     {
         engine.create_timer_callback(
             period,
-            std::bind(&MessageGenerator::timer_callback, this, std::placeholders::_1)
+            std::bind(&MessageGenerator::timer_callback, this, std::placeholders::_1),
+            "message_generator"
         );
     }
 
@@ -46,7 +47,7 @@ public:
     flow::Output<std::string>& out_message() { return out_message_; };
 
 private:
-    void timer_callback(const flow::TimePoint& time)
+    void timer_callback(const flow::TimePoint&)
     {
         auto a = in_a_.get();
         if (!a) return;
@@ -74,14 +75,15 @@ public:
     {
         engine.create_timer_callback(
             period,
-            std::bind(&SequenceGenerator::timer_callback, this, std::placeholders::_1)
+            std::bind(&SequenceGenerator::timer_callback, this, std::placeholders::_1),
+            "sequence_generator"
         );
     }
 
     flow::Output<int>& out_value() { return out_value_; };
 
 private:
-    void timer_callback(const flow::TimePoint& time)
+    void timer_callback(const flow::TimePoint&)
     {
         out_value_.write(value);
         value += step;
@@ -127,9 +129,15 @@ private:
 };
 
 
-int main()
+// Optionally takes a path to write a Chrome trace of the run to
+int main(int argc, char** argv)
 {
-    flow::Engine engine;
+    flow::EngineConfig config;
+    if (argc > 1) {
+        config.tracing = true;
+        config.trace_path = argv[1];
+    }
+    flow::Engine engine(config);
 
     SequenceGenerator a_generator(engine, 1.0 / 20, 0, 1);
     SequenceGenerator b_generator(engine, 1.0 / 4, 0, -5);
@@ -137,6 +145,10 @@ int main()
     MessageViewer message_viewer(engine);
     Timeout timeout(engine, 5.0);
 
+    a_generator.out_value().set_name("a_generator.out_value");
+    b_generator.out_value().set_name("b_generator.out_value");
+    message_generator.out_message().set_name("message_generator.out_message");
+
     flow::connect(a_generator.out_value(), message_generator.in_a());
     flow::connect(b_generator.out_value(), message_generator.in_b());
     flow::connect(message_generator.out_message(), message_viewer.in_message());
@@ -0,0 +1,172 @@
+#include <flow/engine.h>
+#include <flow/recording.h>
+#include <flow/signal.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+
+
+// Records a sensor's readings and status messages for two seconds, then
+// plays the recording back twice: at four times real speed, and as fast as
+// possible from half way through. Seeking there skips over many records,
+// which are all played through to check nothing is lost.
+
+struct Reading {
+    int64_t sequence;
+    double value;
+};
+
+
+// Sensor: Writes a reading every period, and a status message every tenth,
+// stopping after the given number of readings
+// out_reading (Reading): The latest reading
+// out_status (std::string): Describes the latest batch of readings
+class Sensor {
+public:
+    Sensor(flow::Engine& engine, double period, int64_t count):
+        engine(engine),
+        count(count),
+        sequence(0)
+    {
+        engine.create_timer_callback(period, std::bind(&Sensor::callback_timer, this, std::placeholders::_1), "sensor");
+    }
+
+    flow::Output<Reading>& out_reading() { return out_reading_; }
+    flow::Output<std::string>& out_status() { return out_status_; }
+
+private:
+    void callback_timer(const flow::TimePoint& time)
+    {
+        Reading reading = {sequence++, time.time};
+        out_reading_.write(reading);
+        if (reading.sequence % 10 == 0) {
+            out_status_.write("Readings from " + std::to_string(reading.sequence));
+        }
+        if (sequence == count) {
+            engine.stop();
+        }
+    }
+
+    flow::Engine& engine;
+    const int64_t count;
+    int64_t sequence;
+    flow::DirectOutput<Reading> out_reading_;
+    flow::DirectOutput<std::string> out_status_;
+};
+
+
+// Monitor: Counts the messages played back, checks the readings arrive in
+// sequence, and measures how far the engine time drifts from the time each
+// reading was recorded at
+// in_reading (Reading): Readings from the recording
+// in_status (std::string): Status messages from the recording
+class Monitor {
+public:
+    Monitor(flow::Engine& engine):
+        engine(engine),
+        readings(0),
+        statuses(0),
+        first_sequence(-1),
+        last_sequence(-1),
+        gaps(0),
+        max_drift(0),
+        in_reading_(engine, std::bind(&Monitor::callback_reading, this, std::placeholders::_1)),
+        in_status_(engine, std::bind(&Monitor::callback_status, this, std::placeholders::_1))
+    {}
+
+    flow::Input<Reading>& in_reading() { return in_reading_; }
+    flow::Input<std::string>& in_status() { return in_status_; }
+
+    void print() const
+    {
+        std::cout << "Played " << readings << " readings from " << first_sequence << " to " << last_sequence
+            << " and " << statuses << " status messages, max drift " << max_drift << " s" << std::endl;
+    }
+
+    // Played every reading from the first one to the end, without gaps
+    bool played_to_end(int64_t count) const
+    {
+        return readings > 0 && gaps == 0 && last_sequence == count - 1
+            && readings == last_sequence - first_sequence + 1;
+    }
+    int64_t first() const { return first_sequence; }
+
+private:
+    void callback_reading(const Reading& reading)
+    {
+        if (first_sequence < 0) {
+            first_sequence = reading.sequence;
+        } else if (reading.sequence != last_sequence + 1) {
+            gaps++;
+        }
+        last_sequence = reading.sequence;
+        readings++;
+        max_drift = std::max(max_drift, std::abs(engine.get_time().time - reading.value));
+    }
+    void callback_status(const std::string&)
+    {
+        statuses++;
+    }
+
+    flow::Engine& engine;
+    int64_t readings;
+    int64_t statuses;
+    int64_t first_sequence;
+    int64_t last_sequence;
+    int64_t gaps;
+    double max_drift;
+    flow::DirectInput<Reading> in_reading_;
+    flow::DirectInput<std::string> in_status_;
+};
+
+
+// Returns the sequence of the first reading played, or -1 if the readings
+// weren't all played through to the end
+static int64_t play(const std::string& path, const flow::PlaybackConfig& config, int64_t count)
+{
+    flow::Engine engine;
+    flow::Player player(engine, path, config);
+    if (!player.valid()) {
+        std::cerr << "Failed to open recording" << std::endl;
+        return -1;
+    }
+    Monitor monitor(engine);
+    flow::connect(player.channel<Reading>("reading"), monitor.in_reading());
+    flow::connect(player.channel<std::string>("status"), monitor.in_status());
+    engine.run();
+    monitor.print();
+    return monitor.played_to_end(count) ? monitor.first() : -1;
+}
+
+int main()
+{
+    const std::string path = "/tmp/flow_example.flowlog";
+    const double period = 1e-4;
+    const int64_t count = 20000;
+    {
+        flow::Engine engine;
+        flow::Recorder recorder(engine, path);
+        if (!recorder.valid()) {
+            std::cerr << "Failed to create recording" << std::endl;
+            return 1;
+        }
+        Sensor sensor(engine, period, count);
+        recorder.record(sensor.out_reading(), "reading");
+        recorder.record(sensor.out_status(), "status");
+        engine.run();
+        recorder.close();
+        std::cout << "Recorded " << recorder.size() << " bytes" << std::endl;
+    }
+
+    flow::PlaybackConfig config;
+    config.rate = 4;
+    if (play(path, config, count) != 0) return 1;
+
+    config.rate = 0;
+    config.start_time = 0.5 * period * count;
+    int64_t first = play(path, config, count);
+    // Timers may run late, so the readings are only roughly evenly spaced
+    if (first < count / 4 || first > 3 * count / 4) return 1;
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include <flow/callback_group.h>
+#include <flow/engine.h>
+#include <flow/signal.h>
+#include <flow/shm.h>
+#include <cstdint>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+// Passes messages between two processes through shared memory. The
+// process forks into a writer and a reader, each running its own engine.
+
+struct Pose {
+    int64_t sequence;
+    double position[3];
+    double orientation[4];
+};
+
+
+// PoseGenerator: Writes batches of poses with increasing sequence numbers
+// out_pose (Pose): The latest pose
+class PoseGenerator {
+public:
+    PoseGenerator(flow::Engine& engine, double period, size_t batch_size, int64_t count):
+        engine(engine),
+        batch_size(batch_size),
+        count(count),
+        sequence(0),
+        group(engine, flow::CallbackGroupType::MutuallyExclusive, "pose_generator")
+    {
+        // A batch may take longer than the period, so the group stops the
+        // next batch starting before it finishes
+        group.create_timer_callback(period, std::bind(&PoseGenerator::callback_timer, this));
+    }
+
+    flow::Output<Pose>& out_pose() { return out_pose_; }
+
+private:
+    void callback_timer()
+    {
+        for (size_t i = 0; i < batch_size && sequence < count; i++) {
+            Pose pose = {};
+            pose.sequence = sequence++;
+            pose.position[0] = 1e-3 * pose.sequence;
+            pose.orientation[3] = 1;
+            out_pose_.write(pose);
+        }
+        if (sequence == count) {
+            engine.stop();
+        }
+    }
+
+    flow::Engine& engine;
+    const size_t batch_size;
+    const int64_t count;
+    int64_t sequence;
+    flow::CallbackGroup group;
+    flow::DirectOutput<Pose> out_pose_;
+};
+
+
+// PoseChecker: Counts the poses received, and how many were missed or
+// arrived out of order, stopping once the last one arrives
+// in_pose (Pose): Poses from the other process
+class PoseChecker {
+public:
+    PoseChecker(flow::Engine& engine, int64_t count):
+        engine(engine),
+        count(count),
+        received(0),
+        missed(0),
+        reordered(0),
+        last(-1),
+        in_pose_(engine, std::bind(&PoseChecker::callback_pose, this, std::placeholders::_1))
+    {}
+
+    flow::Input<Pose>& in_pose() { return in_pose_; }
+
+    void print() const
+    {
+        std::cout << "Received " << received << " of " << count << " poses, "
+            << missed << " missed, " << reordered << " out of order" << std::endl;
+    }
+
+    bool valid() const
+    {
+        return received == count && missed == 0 && reordered == 0;
+    }
+
+private:
+    void callback_pose(const Pose& pose)
+    {
+        received++;
+        if (pose.sequence <= last) {
+            reordered++;
+        } else {
+            missed += pose.sequence - last - 1;
+            last = pose.sequence;
+        }
+        if (pose.sequence == count - 1) {
+            engine.stop();
+        }
+    }
+
+    flow::Engine& engine;
+    const int64_t count;
+    int64_t received;
+    int64_t missed;
+    int64_t reordered;
+    int64_t last;
+    flow::DirectInput<Pose> in_pose_;
+};
+
+
+int main()
+{
+    const std::string name = "flow_example_poses";
+    const int64_t count = 100000;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Failed to fork" << std::endl;
+        return 1;
+    }
+
+    if (pid == 0) {
+        flow::Engine engine;
+        flow::ShmReader<Pose> reader(engine, name);
+        PoseChecker checker(engine, count);
+        flow::connect(reader, checker.in_pose());
+        engine.run();
+        checker.print();
+        return checker.valid() ? 0 : 1;
+    }
+
+    flow::Engine engine;
+    flow::ShmWriter<Pose> writer(name, 4096);
+    if (!writer.valid()) {
+        std::cerr << "Failed to create shared memory" << std::endl;
+        kill(pid, SIGTERM);
+        return 1;
+    }
+    PoseGenerator generator(engine, 1e-3, 100, count);
+    flow::connect(generator.out_pose(), writer);
+    engine.run();
+    std::cout << "Wrote " << count << " poses, " << writer.dropped() << " dropped" << std::endl;
+    // The reader stops once it receives the last pose, which may have
+    // been dropped
+    if (writer.dropped() > 0) {
+        kill(pid, SIGTERM);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (writer.dropped() > 0 || !WIFEXITED(status)) return 1;
+    return WEXITSTATUS(status);
+}
@@ -0,0 +1,98 @@
+#include <flow/engine.h>
+#include <flow/service.h>
+#include <flow/signal.h>
+#include <flow/socket.h>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+// Connects two processes over a socket. The process forks into a client,
+// which sends log lines and calls a word counting service, and a server,
+// which prints the log lines and provides the service.
+// Optionally takes the address to use, eg: tcp:127.0.0.1:5000
+
+
+// WordCounter: Service returning the number of words in a string
+class WordCounter {
+public:
+    WordCounter(flow::Engine& engine):
+        server_(engine, std::bind(&WordCounter::callback_request, this, std::placeholders::_1))
+    {}
+
+    flow::ServiceServer<std::string, size_t>& server() { return server_; }
+
+private:
+    size_t callback_request(const std::string& request)
+    {
+        size_t count = 0;
+        bool in_word = false;
+        for (char c: request) {
+            if (!in_word && c != ' ') count++;
+            in_word = c != ' ';
+        }
+        return count;
+    }
+
+    flow::ServiceServer<std::string, size_t> server_;
+};
+
+
+int main(int argc, char** argv)
+{
+    const std::string address = argc > 1 ? argv[1] : "unix:/tmp/flow_example.sock";
+    const uint32_t log_channel = 1;
+    const uint32_t word_count_channel = 2;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Failed to fork" << std::endl;
+        return 1;
+    }
+
+    if (pid == 0) {
+        flow::Engine engine;
+        flow::SocketBridge bridge(engine, address, flow::SocketRole::Listen);
+        flow::SocketReader<std::string> in_log(bridge, log_channel);
+        flow::DirectInput<std::string> log_viewer(engine, [&](const std::string& line) {
+            std::cout << "[server] " << line << std::endl;
+            if (line == "done") engine.stop();
+        });
+        flow::connect(in_log, log_viewer);
+
+        flow::SocketServiceClient<std::string, size_t> remote_clients(bridge, word_count_channel);
+        WordCounter word_counter(engine);
+        flow::connect(remote_clients, word_counter.server());
+        engine.run();
+        return 0;
+    }
+
+    flow::Engine engine;
+    flow::SocketBridge bridge(engine, address, flow::SocketRole::Connect);
+    flow::DirectOutput<std::string> out_log;
+    flow::SocketWriter<std::string> log_writer(bridge, log_channel);
+    flow::connect(out_log, log_writer);
+
+    flow::ServiceClient<std::string, size_t> client(engine);
+    flow::SocketServiceServer<std::string, size_t> remote_server(bridge, word_count_channel);
+    flow::connect(client, remote_server);
+
+    engine.create_poll_callback([&]() {
+        while (!bridge.connected()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        for (std::string sentence: {"hello", "passing messages between processes", "one two three four"}) {
+            size_t count = client.sync_call(sentence, 1.0);
+            out_log.write("\"" + sentence + "\" has " + std::to_string(count) + " words");
+        }
+        out_log.write("done");
+        engine.stop();
+        return false;
+    });
+    engine.run();
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include "flow/engine.h"
+#include "flow/bounded_queue.h"
+#include "flow/pooled_queue.h"
+
+
+namespace flow {
+
+// MutuallyExclusive: Callbacks in the group run one at a time, in the
+//   order they were pushed, though not always on the same thread. Each
+//   callback sees everything done by the one before, so state only used
+//   by the group's callbacks needs no lock.
+// Reentrant: Callbacks are pushed straight to the engine, so may run
+//   concurrently. Only groups them for naming and priority.
+enum class CallbackGroupType {
+    MutuallyExclusive,
+    Reentrant
+};
+
+// Runs callbacks on the engine's threads, as one unit for instrumentation
+// and priority. A mutually exclusive group has at most one callback
+// queued on the engine at a time, which runs up to max_batch of the
+// group's callbacks before letting other work in.
+class CallbackGroup {
+    typedef std::function<void(TimePoint time)> timer_callback_t;
+public:
+    CallbackGroup(
+        Engine& engine,
+        CallbackGroupType type = CallbackGroupType::MutuallyExclusive,
+        const std::string& name = "group",
+        Priority priority = Priority::Normal,
+        size_t queue_size = 1024,
+        size_t max_batch = 16
+    );
+
+    CallbackGroup(const CallbackGroup&) = delete;
+    CallbackGroup& operator=(const CallbackGroup&) = delete;
+
+    void push_callback(Task callback);
+    Engine::TimerId create_timer_callback(double period, const timer_callback_t& callback);
+
+    CallbackGroupType type() const { return type_; }
+
+private:
+    bool pop(Task& callback);
+    void process();
+
+    Engine& engine;
+    const CallbackGroupType type_;
+    const Engine::CallbackId id;
+    const Priority priority;
+    const size_t max_batch;
+
+    // Callbacks go in the ring unless it is full, in which case they go in
+    // the overflow queue until it has been emptied, to keep them in order.
+    BoundedQueue<Task> queue;
+    PooledQueue<Task> overflow_queue;
+    std::mutex overflow_mutex;
+    std::atomic<size_t> overflow_count;
+
+    // Number of callbacks pushed but not yet run. Whoever takes it from
+    // zero schedules the group, and it stays scheduled until it is back
+    // to zero.
+    std::atomic<size_t> pending;
+};
+
+} // namespace flow
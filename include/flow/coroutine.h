@@ -0,0 +1,153 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include "flow/engine.h"
+#include "flow/pooled_queue.h"
+#include "flow/signal.h"
+
+namespace flow {
+
+// A coroutine which runs on the engine's callback threads, written as a
+// function returning Coroutine, which can co_await:
+// - engine.sleep_until(time) or engine.sleep_for(duration)
+// - input.next(), for a CoroutineInput
+// - client.co_call(request), for a ServiceClient
+// While suspended it takes no thread, so any number can be waiting at once.
+//
+// It starts once passed to spawn(), and destroys itself when it returns.
+// A coroutine still suspended when the engine stops is never resumed, so
+// anything it owns is not freed.
+
+class Coroutine {
+public:
+    struct promise_type {
+        Coroutine get_return_object()
+        {
+            return Coroutine(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    Coroutine(Coroutine&& other):
+        handle(std::exchange(other.handle, nullptr))
+    {}
+    Coroutine(const Coroutine&) = delete;
+    Coroutine& operator=(const Coroutine&) = delete;
+
+    // Destroys the coroutine if it was never spawned
+    ~Coroutine()
+    {
+        if (handle) handle.destroy();
+    }
+
+private:
+    Coroutine(std::coroutine_handle<promise_type> handle):
+        handle(handle)
+    {}
+    std::coroutine_handle<promise_type> handle;
+
+    friend void spawn(Engine& engine, Coroutine coroutine, Priority priority);
+};
+
+inline void spawn(Engine& engine, Coroutine coroutine, Priority priority = Priority::Normal)
+{
+    std::coroutine_handle<> handle = std::exchange(coroutine.handle, nullptr);
+    engine.push_callback([handle]() { handle.resume(); }, priority);
+}
+
+// Queues messages until a coroutine takes them with co_await next(). If
+// a coroutine is already waiting, the message is handed to it and it is
+// resumed on a callback thread. Only one coroutine may wait at a time.
+// The queue is unbounded, but reuses its nodes once popped.
+
+template <typename T>
+class CoroutineInput: public Input<T> {
+public:
+    CoroutineInput(Engine& engine, Priority priority = Priority::Normal):
+        engine(engine),
+        priority(priority),
+        waiting(nullptr)
+    {}
+
+    class NextAwaiter {
+    public:
+        bool await_ready() const { return false; }
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            std::scoped_lock<std::mutex> lock(input.mutex);
+            T data;
+            if (input.queue.try_pop(data)) {
+                value = std::move(data);
+                return false;
+            }
+            assert(!input.waiting);
+            this->handle = handle;
+            input.waiting = this;
+            return true;
+        }
+        T await_resume() { return std::move(*value); }
+
+    private:
+        NextAwaiter(CoroutineInput& input):
+            input(input)
+        {}
+        CoroutineInput& input;
+        std::coroutine_handle<> handle;
+        std::optional<T> value;
+        friend class CoroutineInput;
+    };
+
+    NextAwaiter next()
+    {
+        return NextAwaiter(*this);
+    }
+
+    size_t size() const
+    {
+        std::scoped_lock<std::mutex> lock(mutex);
+        return queue.size();
+    }
+
+private:
+    void write(const T& data) override
+    {
+        write_value(data);
+    }
+
+    void write(T&& data) override
+    {
+        write_value(std::move(data));
+    }
+
+    template <typename U>
+    void write_value(U&& data)
+    {
+        NextAwaiter* awaiter;
+        {
+            std::scoped_lock<std::mutex> lock(mutex);
+            awaiter = std::exchange(waiting, nullptr);
+            if (!awaiter) {
+                queue.push(std::forward<U>(data));
+                return;
+            }
+        }
+        awaiter->value = std::forward<U>(data);
+        std::coroutine_handle<> handle = awaiter->handle;
+        engine.push_callback([handle]() { handle.resume(); }, priority);
+    }
+
+    Engine& engine;
+    const Priority priority;
+    mutable std::mutex mutex;
+    PooledQueue<T> queue;
+    NextAwaiter* waiting;
+};
+
+} // namespace flow
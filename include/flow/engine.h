@@ -9,61 +9,327 @@
 #include <mutex>
 #include <queue>
 #include <assert.h>
-#include <shared_mutex>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <array>
+#include <coroutine>
 #include "flow/time.h"
+#include "flow/bounded_queue.h"
+#include "flow/pooled_queue.h"
+#include "flow/task.h"
+#include "flow/stats.h"
+#include "flow/trace.h"
+#include "flow/thread.h"
 
 
 namespace flow {
 
+// Fifo: All callbacks go through a single mutex-guarded queue. Simple and
+//   strictly ordered, kept as the reference scheduler.
+// WorkStealing: Each callback thread owns a lock-free run queue. Callbacks
+//   pushed from a callback thread go to its own queue, callbacks pushed from
+//   other threads go to a shared injection queue, and idle threads steal
+//   from the other run queues before parking. Only faster when most
+//   callbacks are pushed by other callbacks, eg: when callbacks write to
+//   callback inputs or push to callback groups. Callbacks pushed from
+//   other threads, such as timers and poll callbacks, cost more than with
+//   Fifo (see worker_throughput and queue_throughput in flow_bench).
+enum class Scheduler {
+    Fifo,
+    WorkStealing
+};
+
+// Callbacks are taken from the highest priority lane with work. A lower
+// lane which has been passed over EngineConfig::starvation_limit times in
+// a row is served next, so it is delayed but never starved.
+// With the WorkStealing scheduler, only Normal callbacks go to the
+// thread-local run queues, High and Low callbacks always go through the
+// shared lanes, and workers check for High callbacks before anything else.
+enum class Priority {
+    High,
+    Normal,
+    Low
+};
+
+struct EngineConfig {
+    Scheduler scheduler = Scheduler::Fifo;
+    size_t worker_queue_size = 1024;
+    size_t starvation_limit = 16;
+    // Timers due in the same pass of the timing thread are dispatched
+    // together, in callbacks running up to timer_chunk_size timers each,
+    // with a single lock of the queue. Timers due within the coalesce
+    // window (in engine seconds) of each other fire in the same pass, so
+    // may fire up to that much early.
+    size_t timer_chunk_size = 8;
+    double timer_coalesce_window = 0;
+    // Engine time starts at zero and only advances once every queued
+    // callback has finished, when it jumps straight to the next timer
+    // deadline, so runs as fast as the callbacks allow. The time source
+    // is ignored, and TimePoint::rate is the average ratio of engine time
+    // to real time since run() started.
+    // Poll callbacks still run freely on their own threads, so anything
+    // they push is only waited for once it has been pushed.
+    bool simulated_time = false;
+    // With simulated time, runs every callback and timer on the thread
+    // calling run(), in a fixed order, so that runs are reproducible.
+    // Always uses the Fifo scheduler.
+    bool deterministic = false;
+    // When a time source is set, the timing thread can't know when the
+    // source will reach the next deadline, so it sleeps at most this long
+    // (in real seconds) before checking again.
+    double time_source_poll_period = 1e-3;
+    // Records per-callback counters and queue depth, see get_stats().
+    bool instrumentation = false;
+    // Records trace events on the engine threads, see write_trace().
+    // If trace_path is set, the trace is written there once run() stops.
+    bool tracing = false;
+    size_t trace_buffer_size = 1 << 16;
+    std::string trace_path;
+    // Threads are named flow-timer, flow-worker-<index> and, for poll
+    // threads, after the poll callback.
+    ThreadConfig timer_thread;
+    ThreadConfig callback_threads;
+    ThreadConfig poll_threads;
+};
+
 class Engine {
     typedef std::function<void()> callback_t;
     typedef std::function<bool()> bool_callback_t;
     typedef std::function<void(TimePoint time)> timer_callback_t;
     typedef std::function<TimePoint()> time_source_t;
 public:
-    Engine();
+    typedef size_t TimerId;
+    // Identifies a named callback for instrumentation and tracing. Null if
+    // both are disabled.
+    typedef CallbackCounters* CallbackId;
 
-    void push_callback(const callback_t& callback);
+    Engine(const EngineConfig& config = EngineConfig());
 
-    void create_poll_callback(const bool_callback_t& poll);
-    void create_poll_shutdown_callback(const bool_callback_t& poll, const callback_t& shutdown);
-    void create_init_poll_callback(const bool_callback_t& init, const bool_callback_t& poll);
-    void create_init_poll_shutdown_callback(const bool_callback_t& init, const bool_callback_t& poll, const callback_t& shutdown);
+    // Callbacks are stored as a Task, so a small callable (such as a lambda
+    // capturing a few pointers) is queued and executed without allocating.
+    void push_callback(Task callback, Priority priority = Priority::Normal);
+    void push_callback(CallbackId id, Task callback, Priority priority = Priority::Normal);
+
+    // Callbacks pushed without an id are counted together, as "unnamed".
+    CallbackId register_callback(const std::string& name);
+    EngineStats get_stats() const;
+    // Writes the trace events recorded so far as Chrome trace JSON. Each
+    // callback is a slice on the thread that ran it, with an arrow from
+    // the slice which pushed it (such as an Output or CallbackInput write),
+    // tagged with the name of the output written.
+    void write_trace(std::ostream& os) const;
+    bool write_trace(const std::string& path) const;
+
+    void create_poll_callback(const bool_callback_t& poll, const std::string& name = "poll");
+    void create_poll_shutdown_callback(const bool_callback_t& poll, const callback_t& shutdown, const std::string& name = "poll");
+    void create_init_poll_callback(const bool_callback_t& init, const bool_callback_t& poll, const std::string& name = "poll");
+    void create_init_poll_shutdown_callback(const bool_callback_t& init, const bool_callback_t& poll, const callback_t& shutdown, const std::string& name = "poll");
     void create_init_callback(const bool_callback_t& init);
     void create_shutdown_callback(const callback_t& shutdown);
 
-    void create_timer_callback(double period, const timer_callback_t& callback);
+    // Timers can be created and cancelled before or after run() starts.
+    // A cancelled timer may still fire once if it was already due.
+    // Timers first fire offset seconds after they start (at time zero, or
+    // when created if already running), so giving timers with the same
+    // period different offsets spreads their load over the period.
+    TimerId create_timer_callback(
+        double period,
+        const timer_callback_t& callback,
+        const std::string& name = "timer",
+        Priority priority = Priority::Normal,
+        double offset = 0);
+    // Fires once, when the engine time reaches the given time
+    TimerId create_deadline_callback(
+        double time,
+        const timer_callback_t& callback,
+        const std::string& name = "deadline",
+        Priority priority = Priority::Normal);
+    // As above, with a name from register_callback(), for callers creating
+    // many deadlines, which would otherwise each register the name again
+    TimerId create_deadline_callback(
+        double time,
+        const timer_callback_t& callback,
+        CallbackId id,
+        Priority priority = Priority::Normal);
+    void cancel_timer_callback(TimerId id);
+
+    // Awaited in a coroutine (see flow/coroutine.h), suspends it until the
+    // engine time reaches the deadline, then resumes it on a callback
+    // thread. Evaluates to the time it was resumed at.
+    class SleepAwaiter {
+    public:
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        TimePoint await_resume() const { return time; }
+    private:
+        SleepAwaiter(Engine& engine, double deadline, Priority priority):
+            engine(engine), deadline(deadline), priority(priority), time()
+        {}
+        Engine& engine;
+        double deadline;
+        Priority priority;
+        TimePoint time;
+        friend class Engine;
+    };
+    SleepAwaiter sleep_until(double time, Priority priority = Priority::Normal);
+    SleepAwaiter sleep_for(double duration, Priority priority = Priority::Normal);
+
+    // May be called from any thread without locking. The clock is read
+    // directly, except with a custom time source, which only the timer
+    // thread calls while running (at least every time_source_poll_period),
+    // and other threads read the time it last published. The clock starts
+    // once the init callbacks finish, and reads zero until then.
     TimePoint get_time() const;
     void set_time_source(const time_source_t& time_source);
+    // Publishes the time source's current time straight away, for sources
+    // which jump forward (eg: playing back a recording), so that get_time()
+    // doesn't lag until the timer thread next reads it. Timers due by then
+    // still wait for the timer thread.
+    void update_time_source();
+    // The time the timers were last fired at, which is the time passed to
+    // the timer callbacks of the current tick. Cheaper than get_time(),
+    // since it only reads a snapshot. Zero before the first tick.
+    TimePoint get_tick_time() const;
 
+    // Runs the init callbacks, then the poll loops, timers and callbacks
+    // until stop() is called (or an init callback fails), then the shutdown
+    // callbacks. Threads waiting for a phase are parked, not spinning.
     void run(size_t num_callback_threads = 4);
     void stop();
 
 private:
+    enum class Phase {
+        Idle,
+        Init,
+        Running,
+        Shutdown,
+        Stopped
+    };
+    bool set_phase(Phase from, Phase to);
+    Phase wait_for_phase(Phase target) const;
+    void configure(std::jthread& thread, const ThreadConfig& thread_config, const std::string& name, size_t index);
+    bool execute_init(const bool_callback_t& init);
+    void run_deterministic();
+    bool execute_next();
+    void execute_poll(const bool_callback_t& poll, CallbackId id);
+
+    struct QueuedCallback {
+        Task task;
+        CallbackId id = nullptr;
+        int64_t push_time = 0;
+        uint64_t flow = 0;
+    };
+    QueuedCallback make_queued(CallbackId id, Task callback);
+    void push_callbacks(CallbackId id, std::vector<std::pair<Task, Priority>>& callbacks);
+    void execute(QueuedCallback& callback);
+    bool pop_lane(QueuedCallback& callback);
     void execute_callback();
+    void execute_timers();
+    void execute_simulated_timers();
+    void fire_timers(const TimePoint& now);
+    bool next_deadline(int64_t& next_time);
+    void advance_time(int64_t next_time);
+    int64_t elapsed_ns(const TimePoint& time) const;
+    TimePoint read_time() const;
+    void start_clock();
+    void execute_callback_stealing(size_t worker);
+    bool pop_callback(size_t worker, QueuedCallback& callback);
 
+    const EngineConfig config;
     time_source_t time_source;
 
-    std::atomic<bool> start_init;
+    std::atomic<Phase> phase;
     std::atomic<int> init_count;
     std::atomic<bool> init_valid;
+    std::vector<callback_t> shutdown_callbacks;
+    std::atomic<size_t> shutdown_count;
 
-    std::atomic<bool> running;
-    TimePoint time;
-    mutable std::shared_mutex time_mutex;
+    // Engine time is kept in integer nanoseconds since the start, so timer
+    // deadlines don't accumulate rounding errors over long runs.
+    std::atomic<int64_t> initial_timestamp;
+    std::atomic<int64_t> run_start;
+    std::atomic<int64_t> sim_time;
+    // Published by the timer thread, under timer_mutex
+    AtomicTimePoint tick_time;
+    AtomicTimePoint source_time;
+    // Queued and executing callbacks, only counted with simulated time
+    std::atomic<size_t> busy_count;
 
+    // A period of zero means the timer fires once
     struct TimerCallback {
-        double period;
-        double next_time;
+        int64_t period;
+        int64_t next_time;
         timer_callback_t callback;
+        CallbackId id;
+        Priority priority;
+    };
+    struct TimerDeadline {
+        int64_t next_time;
+        TimerId id;
+        bool operator>(const TimerDeadline& other) const {
+            return next_time > other.next_time;
+        }
+    };
+    // Cancelled timers are only removed from timer_callbacks, their
+    // deadline is discarded when it reaches the front of the queue.
+    std::unordered_map<TimerId, std::shared_ptr<TimerCallback>> timer_callbacks;
+    std::priority_queue<TimerDeadline, std::vector<TimerDeadline>, std::greater<TimerDeadline>> timer_deadlines;
+    std::vector<TimerDeadline> timer_requeue;
+    TimerId next_timer_id;
+    TimerId add_timer(const std::shared_ptr<TimerCallback>& timer);
+    std::mutex timer_mutex;
+    std::condition_variable timer_cv;
+
+    // Timers fired in one pass, which are shared by the callbacks that run
+    // them. Batches are reused once all of these have finished.
+    struct TimerBatch {
+        TimePoint now;
+        int64_t push_time;
+        std::vector<std::shared_ptr<TimerCallback>> timers;
+        std::atomic<size_t> remaining;
     };
-    std::vector<TimerCallback> timer_callbacks;
+    TimerBatch* acquire_timer_batch();
+    void dispatch_timer_batch(TimerBatch* batch);
+    void execute_timer_chunk(TimerBatch* batch, size_t begin, size_t end);
+    std::vector<std::unique_ptr<TimerBatch>> timer_batches;
+    std::vector<TimerBatch*> free_timer_batches;
+    std::mutex timer_batch_mutex;
+    std::vector<std::pair<Task, Priority>> timer_chunks;
+    std::vector<std::shared_ptr<TimerCallback>> timer_sort_buffer;
+    CallbackId timer_batch_id;
+    CallbackId sleep_id;
 
-    std::queue<callback_t> callback_queue;
-    std::mutex queue_mutex;
+    // Guarded by queue_mutex, indexed by priority
+    static constexpr size_t num_lanes = 3;
+    std::array<PooledQueue<QueuedCallback>, num_lanes> callback_lanes;
+    std::array<size_t, num_lanes> lane_skips;
+    size_t lanes_size;
+    std::atomic<size_t> high_count;
+    mutable std::mutex queue_mutex;
     std::condition_variable cv;
 
+    struct Worker {
+        Worker(size_t queue_size): queue(queue_size), ticks(0) {}
+        BoundedQueue<QueuedCallback> queue;
+        size_t ticks;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> pending_count;
+    std::atomic<size_t> injected_count;
+    std::atomic<size_t> sleeping_count;
+
     std::vector<std::jthread> threads;
+    size_t poll_thread_count;
+
+    // Counters are only added, and are kept until the engine is destroyed,
+    // so ids stay valid and recording into them needs no lock.
+    std::vector<std::unique_ptr<CallbackCounters>> callback_counters;
+    mutable std::mutex counters_mutex;
+    CallbackId unnamed_id;
+    ShardedHistogram queue_depth;
+
+    std::unique_ptr<Tracer> tracer;
 };
 
 } // namespace flow
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+
+namespace flow {
+
+// Epoch-based reclamation, for data which lock-free readers use while
+// writers replace it. A reader wraps its use in an EpochReadSection, which
+// only writes to a record owned by its thread. A writer publishes the new
+// data, then retires the old data with epoch_retire(), and can free it
+// once epoch_oldest_reader() is later than the epoch it was retired in.
+//
+// On Linux the writer uses the membarrier syscall to make every reader's
+// record visible, so read sections need no memory fence, and writers (who
+// are assumed rare) take the cost instead. Elsewhere, and on kernels
+// without membarrier, each read section takes a fence.
+
+struct EpochRecord {
+    // Epoch the outermost read section started in, or zero if none
+    std::atomic<uint64_t> epoch;
+    uint32_t depth;
+    bool registered;
+};
+
+extern std::atomic<uint64_t> global_epoch;
+extern bool epoch_membarrier;
+// Constant initialized, so using it needs no guard. Each thread registers
+// its record on its first read section, and unregisters it on exit.
+inline constinit thread_local EpochRecord epoch_record = {0, 0, false};
+void epoch_register_thread();
+
+// Read sections may nest, and only the outermost is recorded
+class EpochReadSection {
+public:
+    EpochReadSection()
+    {
+        EpochRecord& record = epoch_record;
+        if (record.depth++ > 0) return;
+        if (!record.registered) epoch_register_thread();
+        record.epoch.store(global_epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+        // Orders the store before the reads of the protected data
+        if (epoch_membarrier) {
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        } else {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+    ~EpochReadSection()
+    {
+        EpochRecord& record = epoch_record;
+        if (--record.depth > 0) return;
+        record.epoch.store(0, std::memory_order_release);
+    }
+
+    EpochReadSection(const EpochReadSection&) = delete;
+    EpochReadSection& operator=(const EpochReadSection&) = delete;
+};
+
+// Call after publishing the replacement. Returns the epoch the old data
+// was retired in.
+uint64_t epoch_retire();
+
+// The epoch of the oldest read section in progress, or the current epoch
+// if there are none. Data retired in an earlier epoch is no longer used.
+uint64_t epoch_oldest_reader();
+
+// Waits until every read section that other threads started in or before
+// the epoch has finished. A read section of the calling thread isn't
+// waited for, since it can't finish until this returns.
+void epoch_synchronize(uint64_t epoch);
+
+} // namespace flow
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "flow/signal.h"
+
+
+namespace flow {
+
+// A pipeline is a chain of stages wired together at compile time, for
+// tight chains (eg: sensor -> filter -> controller) where passing each
+// message through Output<T> and Input<T> costs more than the work done.
+// Each stage is a callable, held by value, which takes the previous
+// stage's message and is one of:
+// - A transform, returning the next message.
+// - A filter, returning std::optional of the next message, which is only
+//   passed on if it has a value.
+// - A sink, returning void, which must be the last stage.
+// - A general stage, taking the message and an emit callable, which it
+//   calls with each message to pass on (any number, of any type).
+// Since the whole chain is one type, the compiler can inline every stage
+// into a single function, with no virtual calls or std::function.
+//
+// Pipelines run on the thread that writes to them, like DirectInput, so
+// a pipeline written from several threads must be safe to call
+// concurrently. Use StaticInput to feed a pipeline from the runtime graph,
+// and write_to() to pass its messages back to a runtime output.
+
+template <typename T>
+struct is_optional: std::false_type {};
+
+template <typename T>
+struct is_optional<std::optional<T>>: std::true_type {};
+
+template <typename... Stages>
+class Pipeline;
+
+template <>
+class Pipeline<> {
+public:
+    // Messages past the last stage are discarded
+    template <typename U>
+    void operator()(U&&) {}
+};
+
+template <typename Stage, typename... Rest>
+class Pipeline<Stage, Rest...> {
+public:
+    Pipeline(Stage stage, Rest... rest):
+        stage(std::move(stage)),
+        rest(std::move(rest)...)
+    {}
+
+    template <typename U>
+    void operator()(U&& value)
+    {
+        if constexpr (std::is_invocable_v<Stage&, U&&>) {
+            typedef std::invoke_result_t<Stage&, U&&> result_t;
+            if constexpr (std::is_void_v<result_t>) {
+                static_assert(sizeof...(Rest) == 0, "A stage returning void must be the last stage");
+                stage(std::forward<U>(value));
+            } else if constexpr (is_optional<result_t>::value) {
+                auto result = stage(std::forward<U>(value));
+                if (result) {
+                    rest(std::move(*result));
+                }
+            } else {
+                rest(stage(std::forward<U>(value)));
+            }
+        } else {
+            static_assert(std::is_invocable_v<Stage&, U&&, Pipeline<Rest...>&>,
+                "A stage must take the message, or the message and an emit callable");
+            stage(std::forward<U>(value), rest);
+        }
+    }
+
+private:
+    Stage stage;
+    Pipeline<Rest...> rest;
+};
+
+template <typename... Stages>
+Pipeline<std::decay_t<Stages>...> pipeline(Stages&&... stages)
+{
+    return Pipeline<std::decay_t<Stages>...>(std::forward<Stages>(stages)...);
+}
+
+// A sink stage which passes each message to every branch in turn, where
+// each branch is a stage or pipeline
+template <typename... Branches>
+class FanOut {
+public:
+    FanOut(Branches... branches):
+        branches(std::move(branches)...)
+    {}
+
+    template <typename U>
+    void operator()(const U& value)
+    {
+        std::apply([&](auto&... branch) { (branch(value), ...); }, branches);
+    }
+
+private:
+    std::tuple<Branches...> branches;
+};
+
+template <typename... Branches>
+FanOut<std::decay_t<Branches>...> fan_out(Branches&&... branches)
+{
+    return FanOut<std::decay_t<Branches>...>(std::forward<Branches>(branches)...);
+}
+
+// A sink stage which writes each message to a runtime output, which must
+// outlive the pipeline
+template <typename T>
+auto write_to(Output<T>& output)
+{
+    return [&output](auto&& value) {
+        output.write(std::forward<decltype(value)>(value));
+    };
+}
+
+// Feeds the messages written to it into a pipeline, so the pipeline costs
+// one virtual call when connected to a runtime output.
+template <typename T, typename Stages>
+class StaticInput: public Input<T> {
+public:
+    StaticInput(Stages stages):
+        stages(std::move(stages))
+    {}
+
+private:
+    void write(const T& value) override
+    {
+        stages(value);
+    }
+    void write(T&& value) override
+    {
+        stages(std::move(value));
+    }
+
+    Stages stages;
+};
+
+template <typename T, typename... Stages>
+StaticInput<T, Pipeline<std::decay_t<Stages>...>> static_input(Stages&&... stages)
+{
+    return StaticInput<T, Pipeline<std::decay_t<Stages>...>>(pipeline(std::forward<Stages>(stages)...));
+}
+
+} // namespace flow
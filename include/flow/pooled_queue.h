@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+
+namespace flow {
+
+// Unbounded FIFO queue which isn't thread-safe, so must be guarded by the
+// owner. Popped nodes go on a free list and are reused by later pushes,
+// so once the queue has reached its working size it stops allocating.
+
+template <typename T>
+class PooledQueue {
+public:
+    PooledQueue():
+        head(nullptr),
+        tail(nullptr),
+        free(nullptr),
+        count(0)
+    {}
+
+    PooledQueue(const PooledQueue&) = delete;
+    PooledQueue& operator=(const PooledQueue&) = delete;
+
+    ~PooledQueue()
+    {
+        delete_nodes(head);
+        delete_nodes(free);
+    }
+
+    template <typename U>
+    void push(U&& value)
+    {
+        Node* node = free;
+        if (node) {
+            free = node->next;
+        } else {
+            node = new Node();
+        }
+        node->value = std::forward<U>(value);
+        node->next = nullptr;
+        if (tail) {
+            tail->next = node;
+        } else {
+            head = node;
+        }
+        tail = node;
+        count++;
+    }
+
+    bool try_pop(T& value)
+    {
+        Node* node = head;
+        if (!node) return false;
+        head = node->next;
+        if (!head) tail = nullptr;
+        value = std::move(node->value);
+        node->value = T();
+        node->next = free;
+        free = node;
+        count--;
+        return true;
+    }
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+private:
+    struct Node {
+        T value;
+        Node* next;
+    };
+
+    static void delete_nodes(Node* node)
+    {
+        while (node) {
+            Node* next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+
+    Node* head;
+    Node* tail;
+    Node* free;
+    size_t count;
+};
+
+} // namespace flow
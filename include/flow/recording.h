@@ -0,0 +1,215 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "flow/engine.h"
+#include "flow/serialize.h"
+#include "flow/signal.h"
+
+
+namespace flow {
+
+// A recording is a log file of messages, each tagged with the engine time
+// it was written at and the channel (named by the recorded output) it was
+// written to, plus an index file (the log path with ".index" appended)
+// used to seek within it. Messages are serialized with Serializer<T>, in
+// the host's byte order. Only supported on Linux.
+//
+// The log is self-contained: channel names are also written into it, so
+// it can still be played back if the recorder was killed before writing
+// the index.
+
+// Position of a record in the log, every so often, for seeking
+struct RecordingIndexEntry {
+    int64_t time;
+    uint64_t offset;
+};
+
+// Appends the messages of any number of outputs to a log, which is
+// memory-mapped and grown chunk_size bytes at a time, so each message is
+// serialized straight into the file. The recorded outputs are disconnected
+// on close(), so must not be destroyed before then, but may outlive the
+// recorder.
+class Recorder {
+public:
+    Recorder(Engine& engine, const std::string& path, size_t chunk_size = 64 << 20);
+    ~Recorder();
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+
+    // False if the log couldn't be created
+    bool valid() const { return data != nullptr; }
+    // Bytes written to the log so far
+    size_t size() const;
+
+    // Connects the output to a new channel of the recording
+    template <typename T>
+    void record(Output<T>& output, const std::string& name)
+    {
+        auto input = std::make_unique<RecordInput<T>>(*this, output, add_channel(name));
+        connect(output, *input);
+        inputs.push_back(std::move(input));
+    }
+
+    // Disconnects the recorded outputs, waiting for any writes to them in
+    // progress, then truncates the log to its final size and writes the
+    // index. Called by the destructor, if not before. Don't call it from
+    // inside a write to a recorded output, which it can't wait for.
+    void close();
+
+private:
+    class RecordInputBase {
+    public:
+        virtual ~RecordInputBase() {}
+        virtual void detach() = 0;
+    };
+
+    template <typename T>
+    class RecordInput: public Input<T>, public RecordInputBase {
+    public:
+        RecordInput(Recorder& recorder, Output<T>& output, uint32_t channel):
+            recorder(recorder),
+            output(output),
+            channel(channel),
+            attached(true)
+        {}
+        void detach() override
+        {
+            if (!attached) return;
+            disconnect(output, *this);
+            attached = false;
+        }
+    private:
+        void write(const T& value) override
+        {
+            std::scoped_lock<std::mutex> lock(recorder.mutex);
+            uint8_t* data = recorder.append(channel, serialized_size(value), recorder.engine.get_time().time);
+            if (data) serialize(value, data);
+        }
+        Recorder& recorder;
+        Output<T>& output;
+        const uint32_t channel;
+        bool attached;
+    };
+
+    uint32_t add_channel(const std::string& name);
+    // Reserves space for a record and writes its header, returning where
+    // to write the message. Must hold mutex.
+    uint8_t* append(uint32_t channel, size_t size, double time);
+    bool grow(size_t required);
+
+    Engine& engine;
+    const std::string path;
+    const size_t chunk_size;
+    int fd;
+    uint8_t* data;
+    size_t capacity;
+    size_t end;
+    mutable std::mutex mutex;
+
+    std::vector<RecordingIndexEntry> index;
+    size_t next_index_offset;
+    std::vector<std::string> channels;
+    std::vector<std::unique_ptr<RecordInputBase>> inputs;
+};
+
+struct PlaybackConfig {
+    // Speed relative to the recording, or zero to play as fast as possible
+    double rate = 1;
+    // Seconds into the recording to start from
+    double start_time = 0;
+    // Stop the engine once every message has been played
+    bool stop_at_end = true;
+};
+
+// Plays a recording back into the engine, from a poll callback, and sets
+// the engine's time source to the time within the recording. The log is
+// memory-mapped, so messages are deserialized straight from the page cache.
+//
+// The engine time is updated before each message is written, so callbacks
+// see the time it was recorded at (or later, if playing at a rate). When
+// playing as fast as possible, timers only fire once the timer thread next
+// reads the time, at least every EngineConfig::time_source_poll_period, so
+// may fire late relative to the messages.
+class Player {
+public:
+    Player(Engine& engine, const std::string& path, const PlaybackConfig& config = PlaybackConfig());
+    ~Player();
+    Player(const Player&) = delete;
+    Player& operator=(const Player&) = delete;
+
+    // False if the log couldn't be opened or is invalid
+    bool valid() const { return data != nullptr; }
+
+    // Output for the messages recorded under the name, which must be
+    // requested before calling run(). If the recording has no such
+    // channel, the output never writes.
+    template <typename T>
+    Output<T>& channel(const std::string& name)
+    {
+        auto output = std::make_unique<PlayOutput<T>>();
+        PlayOutput<T>* result = output.get();
+        add_output(name, std::move(output));
+        return *result;
+    }
+
+    bool finished() const { return finished_; }
+    size_t messages() const { return message_count; }
+    size_t bytes() const { return byte_count; }
+
+private:
+    class PlayOutputBase {
+    public:
+        virtual ~PlayOutputBase() {}
+        virtual void play(const uint8_t* data, size_t size) = 0;
+    };
+
+    template <typename T>
+    class PlayOutput: public Output<T>, public PlayOutputBase {
+    public:
+        void write(const T& value) override
+        {
+            this->write_value(value);
+        }
+        void play(const uint8_t* data, size_t size) override
+        {
+            if (deserialize(value, data, size)) {
+                this->write_value(value);
+            }
+        }
+    private:
+        // Kept between messages, so strings and vectors reuse their memory
+        T value;
+    };
+
+    void add_output(const std::string& name, std::unique_ptr<PlayOutputBase>&& output);
+    bool read_index();
+    void scan_channels();
+    void seek(int64_t time);
+    bool poll();
+    TimePoint get_time() const;
+
+    Engine& engine;
+    const PlaybackConfig config;
+    const std::string path;
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+
+    std::vector<RecordingIndexEntry> index;
+    std::vector<std::string> channel_names;
+    std::vector<std::vector<PlayOutputBase*>> channel_outputs;
+    std::vector<std::unique_ptr<PlayOutputBase>> outputs;
+
+    std::atomic<int64_t> play_time;
+    std::atomic<int64_t> real_start;
+    std::atomic<bool> finished_;
+    std::atomic<size_t> message_count;
+    std::atomic<size_t> byte_count;
+};
+
+} // namespace flow
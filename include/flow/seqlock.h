@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+
+namespace flow {
+
+// Holds a trivially copyable value which readers copy out without ever
+// blocking a writer. A reader retries if a write happened while it was
+// copying. Concurrent writers take turns, but never wait for readers.
+// The value is stored as atomic words, so the overlapping read and write
+// isn't a data race.
+
+template <typename T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable_v<T>, "SeqLock requires a trivially copyable type");
+    static constexpr size_t num_words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+public:
+    SeqLock(const T& value = T()):
+        sequence(0)
+    {
+        store(value);
+    }
+
+    SeqLock(const SeqLock&) = delete;
+    SeqLock& operator=(const SeqLock&) = delete;
+
+    void store(const T& value)
+    {
+        uint64_t buffer[num_words] = {};
+        std::memcpy(buffer, &value, sizeof(T));
+
+        // An odd sequence number marks a write in progress
+        uint64_t before = sequence.load(std::memory_order_relaxed);
+        while ((before & 1) || !sequence.compare_exchange_weak(before, before + 1, std::memory_order_relaxed)) {
+            before = sequence.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < num_words; i++) {
+            words[i].store(buffer[i], std::memory_order_relaxed);
+        }
+        sequence.store(before + 2, std::memory_order_release);
+    }
+
+    bool try_load(T& value) const
+    {
+        uint64_t before = sequence.load(std::memory_order_acquire);
+        if (before & 1) return false;
+
+        uint64_t buffer[num_words];
+        for (size_t i = 0; i < num_words; i++) {
+            buffer[i] = words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence.load(std::memory_order_relaxed) != before) return false;
+
+        std::memcpy(&value, buffer, sizeof(T));
+        return true;
+    }
+
+    T load() const
+    {
+        T value;
+        while (!try_load(value)) {}
+        return value;
+    }
+
+private:
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> words[num_words];
+};
+
+} // namespace flow
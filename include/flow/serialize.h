@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+namespace flow {
+
+// Binary serialization of messages, for passing them between processes
+// or hosts. Values are written in the host's byte order, so both ends must
+// share it. Specialize Serializer<T> for other message types, with:
+// - size(value): The number of bytes write() will write
+// - write(value, data): Writes the value to data, returning the end of
+//   what it wrote
+// - read(value, data, end): Reads the value from data, returning the end
+//   of what it read, or null if the data is invalid
+// Serializing never allocates, since the buffer is sized up front.
+//
+// Serializer doesn't depend on parrot, though it is linked: nothing in
+// flow includes parrot's headers yet. Types described with parrot can be
+// sent by specializing Serializer for them.
+
+template <typename T, typename Enable = void>
+struct Serializer;
+
+// Trivially copyable types are copied byte for byte
+template <typename T>
+struct Serializer<T, std::enable_if_t<std::is_trivially_copyable_v<T>>> {
+    static size_t size(const T&)
+    {
+        return sizeof(T);
+    }
+    static uint8_t* write(const T& value, uint8_t* data)
+    {
+        std::memcpy(data, &value, sizeof(T));
+        return data + sizeof(T);
+    }
+    static const uint8_t* read(T& value, const uint8_t* data, const uint8_t* end)
+    {
+        if (size_t(end - data) < sizeof(T)) return nullptr;
+        std::memcpy(&value, data, sizeof(T));
+        return data + sizeof(T);
+    }
+};
+
+// Strings and vectors are written as a 64-bit count followed by the
+// elements, where trivially copyable elements are copied all at once.
+template <>
+struct Serializer<std::string> {
+    static size_t size(const std::string& value)
+    {
+        return sizeof(uint64_t) + value.size();
+    }
+    static uint8_t* write(const std::string& value, uint8_t* data)
+    {
+        data = Serializer<uint64_t>::write(value.size(), data);
+        std::memcpy(data, value.data(), value.size());
+        return data + value.size();
+    }
+    static const uint8_t* read(std::string& value, const uint8_t* data, const uint8_t* end)
+    {
+        uint64_t count;
+        data = Serializer<uint64_t>::read(count, data, end);
+        if (!data || uint64_t(end - data) < count) return nullptr;
+        value.assign(reinterpret_cast<const char*>(data), count);
+        return data + count;
+    }
+};
+
+template <typename T>
+struct Serializer<std::vector<T>> {
+    static_assert(!std::is_same_v<T, bool>, "std::vector<bool> isn't supported");
+    static constexpr bool flat = std::is_trivially_copyable_v<T>;
+
+    static size_t size(const std::vector<T>& value)
+    {
+        if constexpr (flat) {
+            return sizeof(uint64_t) + value.size() * sizeof(T);
+        } else {
+            size_t result = sizeof(uint64_t);
+            for (const T& element: value) {
+                result += Serializer<T>::size(element);
+            }
+            return result;
+        }
+    }
+    static uint8_t* write(const std::vector<T>& value, uint8_t* data)
+    {
+        data = Serializer<uint64_t>::write(value.size(), data);
+        if constexpr (flat) {
+            std::memcpy(data, value.data(), value.size() * sizeof(T));
+            return data + value.size() * sizeof(T);
+        } else {
+            for (const T& element: value) {
+                data = Serializer<T>::write(element, data);
+            }
+            return data;
+        }
+    }
+    static const uint8_t* read(std::vector<T>& value, const uint8_t* data, const uint8_t* end)
+    {
+        uint64_t count;
+        data = Serializer<uint64_t>::read(count, data, end);
+        if (!data) return nullptr;
+        if constexpr (flat) {
+            if (uint64_t(end - data) / sizeof(T) < count) return nullptr;
+            value.resize(count);
+            std::memcpy(value.data(), data, count * sizeof(T));
+            return data + count * sizeof(T);
+        } else {
+            // Each element takes at least one byte, which bounds the
+            // count before resizing
+            if (uint64_t(end - data) < count) return nullptr;
+            value.resize(count);
+            for (T& element: value) {
+                data = Serializer<T>::read(element, data, end);
+                if (!data) return nullptr;
+            }
+            return data;
+        }
+    }
+};
+
+template <typename T>
+size_t serialized_size(const T& value)
+{
+    return Serializer<T>::size(value);
+}
+
+template <typename T>
+uint8_t* serialize(const T& value, uint8_t* data)
+{
+    return Serializer<T>::write(value, data);
+}
+
+// Returns false unless the data holds exactly one valid value
+template <typename T>
+bool deserialize(T& value, const uint8_t* data, size_t size)
+{
+    const uint8_t* end = data + size;
+    return Serializer<T>::read(value, data, end) == end;
+}
+
+} // namespace flow
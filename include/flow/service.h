@@ -1,15 +1,80 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include <optional>
 #include <atomic>
+#include <coroutine>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <future>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+#include "flow/serialize.h"
 #include "flow/signal.h"
 
 namespace flow {
 
+// A request or response, tagged with the id of the call, which the client
+// uses to match each response to its request.
+template <typename T>
+struct ServiceMessage {
+    uint64_t id;
+    T value;
+};
+
+// Serialized as the id followed by the value. A message with a trivially
+// copyable value is trivially copyable itself, so is copied as a whole.
+template <typename T>
+struct Serializer<ServiceMessage<T>, std::enable_if_t<!std::is_trivially_copyable_v<ServiceMessage<T>>>> {
+    static size_t size(const ServiceMessage<T>& message)
+    {
+        return sizeof(uint64_t) + Serializer<T>::size(message.value);
+    }
+    static uint8_t* write(const ServiceMessage<T>& message, uint8_t* data)
+    {
+        data = Serializer<uint64_t>::write(message.id, data);
+        return Serializer<T>::write(message.value, data);
+    }
+    static const uint8_t* read(ServiceMessage<T>& message, const uint8_t* data, const uint8_t* end)
+    {
+        data = Serializer<uint64_t>::read(message.id, data, end);
+        if (!data) return nullptr;
+        return Serializer<T>::read(message.value, data, end);
+    }
+};
+
+// Ids are unique across all clients, since a server's responses reach
+// every client connected to it. They start from a random offset, so that
+// clients in different processes sharing a server (through a socket
+// bridge) don't collide either.
+inline uint64_t next_service_call_id()
+{
+    static std::atomic<uint64_t> next_id((uint64_t(std::random_device()()) << 32) | 1);
+    return next_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+class ServiceTimeout: public std::runtime_error {
+public:
+    ServiceTimeout(): std::runtime_error("Service call timed out") {}
+};
+
+// Any number of calls may be in flight at once, from any thread. Each
+// completes through either a future or a callback, which is pushed to the
+// engine, so neither the server nor the caller waits for it.
+//
+// A call with a timeout (in seconds of engine time, so simulated if the
+// engine is) fails if no response has arrived by then: the future throws
+// ServiceTimeout, or the timeout callback is pushed instead. While any call
+// has a timeout, a one-shot deadline timer is kept for the earliest one, so
+// an idle client has no timer, and simulated time isn't stepped for it.
+//
+// sync_call() blocks the calling thread, so from an engine callback prefer
+// async_call(), or co_call() in a coroutine.
+
 template <typename Request_, typename Response_>
 class ServiceClient {
 public:
@@ -18,49 +83,242 @@ public:
 
     ServiceClient(Engine& engine):
         engine(engine),
-        in_response_(engine, std::bind(&ServiceClient::callback_response, this, std::placeholders::_1))
+        in_response_(engine, [this](const ServiceMessage<Response>& response) { callback_response(response); }),
+        timer_id(engine.register_callback("service_timeouts")),
+        timer_guard(std::make_shared<TimerGuard>()),
+        timer(0),
+        timer_armed(false),
+        timer_deadline(0),
+        timer_generation(0)
     {}
 
-    Response sync_call(const Request& request)
+    ~ServiceClient()
+    {
+        {
+            // Waits for a deadline timer which is running, and stops any
+            // which is already due from using the client
+            std::scoped_lock<std::mutex> lock(timer_guard->mutex);
+            timer_guard->alive = false;
+        }
+        std::scoped_lock<std::mutex> lock(mutex);
+        if (timer_armed) {
+            engine.cancel_timer_callback(timer);
+        }
+    }
+
+    ServiceClient(const ServiceClient&) = delete;
+    ServiceClient& operator=(const ServiceClient&) = delete;
+
+    std::future<Response> call(const Request& request, double timeout = 0)
+    {
+        Pending pending;
+        std::future<Response> future = pending.promise.get_future();
+        send(request, std::move(pending), timeout);
+        return future;
+    }
+
+    Response sync_call(const Request& request, double timeout = 0)
     {
-        callback = std::nullopt;
-        response = std::promise<Response>();
-        out_request_.write(request);
-        return response.get_future().get();
+        return call(request, timeout).get();
     }
 
     typedef std::function<void(const Response&)> callback_t;
-    void async_call(const Request& request, const callback_t& callback)
+    typedef std::function<void()> timeout_callback_t;
+    void async_call(
+        const Request& request,
+        const callback_t& callback,
+        double timeout = 0,
+        const timeout_callback_t& timeout_callback = nullptr)
     {
-        this->callback = callback;
-        response = std::promise<Response>();
-        out_request_.write(request);
+        Pending pending;
+        pending.callback = callback;
+        pending.timeout_callback = timeout_callback;
+        send(request, std::move(pending), timeout);
     }
 
-    Output<Request>& out_request() { return out_request_; }
-    Input<Response>& in_response() { return in_response_; }
+    // Awaited in a coroutine (see flow/coroutine.h), makes the call and
+    // suspends until it completes, without blocking a thread. Evaluates to
+    // the response, or nullopt if the call timed out.
+    class CallAwaiter {
+    public:
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            client.async_call(
+                request,
+                [this, handle](const Response& value) {
+                    response = value;
+                    handle.resume();
+                },
+                timeout,
+                [handle]() { handle.resume(); });
+        }
+        std::optional<Response> await_resume() { return std::move(response); }
+
+    private:
+        CallAwaiter(ServiceClient& client, const Request& request, double timeout):
+            client(client),
+            request(request),
+            timeout(timeout)
+        {}
+        ServiceClient& client;
+        Request request;
+        double timeout;
+        std::optional<Response> response;
+        friend class ServiceClient;
+    };
+
+    CallAwaiter co_call(const Request& request, double timeout = 0)
+    {
+        return CallAwaiter(*this, request, timeout);
+    }
+
+    // Calls which haven't yet completed or timed out
+    size_t in_flight() const
+    {
+        std::scoped_lock<std::mutex> lock(mutex);
+        return pending_calls.size();
+    }
+
+    Output<ServiceMessage<Request>>& out_request() { return out_request_; }
+    Input<ServiceMessage<Response>>& in_response() { return in_response_; }
 
 private:
-    void callback_response(const Response& response)
+    // Completes through the promise if there is no callback
+    struct Pending {
+        std::promise<Response> promise;
+        callback_t callback;
+        timeout_callback_t timeout_callback;
+    };
+
+    void send(const Request& request, Pending&& pending, double timeout)
     {
-        this->response.set_value(response);
-        if (callback) {
-            engine.push_callback(std::bind(&ServiceClient::process, this));
+        uint64_t id = next_service_call_id();
+        {
+            std::scoped_lock<std::mutex> lock(mutex);
+            pending_calls.emplace(id, std::move(pending));
+            if (timeout > 0) {
+                double deadline = engine.get_time().time + timeout;
+                deadlines.push({deadline, id});
+                if (!timer_armed || deadline < timer_deadline) {
+                    arm_timer(deadline);
+                }
+            }
         }
+        // Registered before writing, since the response may arrive before
+        // the write returns.
+        out_request_.write(ServiceMessage<Request>{id, request});
     }
-    void process()
+
+    void callback_response(const ServiceMessage<Response>& response)
     {
-        callback.value()(response.get_future().get());
+        Pending pending;
+        {
+            std::scoped_lock<std::mutex> lock(mutex);
+            auto iter = pending_calls.find(response.id);
+            // Another client's call, or one which timed out
+            if (iter == pending_calls.end()) return;
+            pending = std::move(iter->second);
+            pending_calls.erase(iter);
+        }
+        if (pending.callback) {
+            engine.push_callback([callback = std::move(pending.callback), value = response.value]() {
+                callback(value);
+            });
+        } else {
+            pending.promise.set_value(response.value);
+        }
+    }
+
+    // Replaces the deadline timer with one for the given deadline. Must
+    // hold mutex.
+    void arm_timer(double deadline)
+    {
+        if (timer_armed) {
+            engine.cancel_timer_callback(timer);
+        }
+        uint64_t generation = ++timer_generation;
+        timer = engine.create_deadline_callback(
+            deadline,
+            [this, guard = timer_guard, generation](const TimePoint& time) {
+                std::scoped_lock<std::mutex> lock(guard->mutex);
+                if (guard->alive) check_timeouts(time, generation);
+            },
+            timer_id);
+        timer_armed = true;
+        timer_deadline = deadline;
+    }
+
+    // A cancelled timer may still fire if it was already due, in which
+    // case its generation is out of date, and the current timer is kept.
+    // If the client was destroyed, the timer's guard stops it first.
+    void check_timeouts(const TimePoint& time, uint64_t generation)
+    {
+        std::vector<Pending> expired;
+        {
+            std::scoped_lock<std::mutex> lock(mutex);
+            // Timers may fire slightly early, within the engine's coalesce
+            // window, so the timer's own deadline counts as reached
+            double now = time.time;
+            if (generation == timer_generation) {
+                timer_armed = false;
+                now = std::max(now, timer_deadline);
+            }
+            while (!deadlines.empty()) {
+                auto iter = pending_calls.find(deadlines.top().second);
+                if (iter == pending_calls.end()) {
+                    deadlines.pop();
+                    continue;
+                }
+                if (deadlines.top().first > now) break;
+                deadlines.pop();
+                expired.push_back(std::move(iter->second));
+                pending_calls.erase(iter);
+            }
+            if (!deadlines.empty() && (!timer_armed || deadlines.top().first < timer_deadline)) {
+                arm_timer(deadlines.top().first);
+            }
+        }
+        for (Pending& pending: expired) {
+            if (pending.callback) {
+                if (pending.timeout_callback) {
+                    engine.push_callback([timeout_callback = std::move(pending.timeout_callback)]() {
+                        timeout_callback();
+                    });
+                }
+            } else {
+                pending.promise.set_exception(std::make_exception_ptr(ServiceTimeout()));
+            }
+        }
     }
 
     Engine& engine;
-    DirectOutput<Request> out_request_;
-    DirectInput<Response> in_response_;
+    DirectOutput<ServiceMessage<Request>> out_request_;
+    DirectInput<ServiceMessage<Response>> in_response_;
 
-    std::optional<callback_t> callback;
-    std::promise<Response> response;
+    typedef std::pair<double, uint64_t> deadline_t;
+    mutable std::mutex mutex;
+    std::unordered_map<uint64_t, Pending> pending_calls;
+    // Deadlines of calls which have since completed are left in the
+    // queue, and skipped when the timer next fires.
+    std::priority_queue<deadline_t, std::vector<deadline_t>, std::greater<deadline_t>> deadlines;
+    const Engine::CallbackId timer_id;
+    // Shared with the deadline timers, which may outlive the client
+    struct TimerGuard {
+        std::mutex mutex;
+        bool alive = true;
+    };
+    std::shared_ptr<TimerGuard> timer_guard;
+    Engine::TimerId timer;
+    bool timer_armed;
+    double timer_deadline;
+    uint64_t timer_generation;
 };
 
+// Requests are handled one at a time, in the order they arrive. Requests
+// beyond queue_size go to an overflow list rather than blocking the client,
+// since a client making many calls from callback threads could otherwise
+// block every thread, leaving none to run the server.
 template <typename Request_, typename Response_>
 class ServiceServer {
 public:
@@ -68,24 +326,24 @@ public:
     typedef Response_ Response;
 
     typedef std::function<Response(const Request& request)> callback_t;
-    ServiceServer(Engine& engine, const callback_t& callback):
+    ServiceServer(Engine& engine, const callback_t& callback, size_t queue_size = 100):
         callback(callback),
-        in_request_(engine, std::bind(&ServiceServer::callback_request, this, std::placeholders::_1))
+        in_request_(engine, [this](const ServiceMessage<Request>& request) { callback_request(request); }, queue_size, OverflowPolicy::Grow)
     {}
 
-    Output<Response>& out_response() { return out_response_; };
-    Input<Request>& in_request() { return in_request_; }
+    Output<ServiceMessage<Response>>& out_response() { return out_response_; };
+    Input<ServiceMessage<Request>>& in_request() { return in_request_; }
 
 private:
-    void callback_request(const Request& request)
+    void callback_request(const ServiceMessage<Request>& request)
     {
-        out_response_.write(callback(request));
+        out_response_.write(ServiceMessage<Response>{request.id, callback(request.value)});
     }
 
-    DirectOutput<Response> out_response_;
-    CallbackInput<Request> in_request_;
-
     callback_t callback;
+
+    DirectOutput<ServiceMessage<Response>> out_response_;
+    CallbackInput<ServiceMessage<Request>> in_request_;
 };
 
 template <typename Request, typename Response>
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include "flow/engine.h"
+#include "flow/signal.h"
+
+
+namespace flow {
+
+// Ring buffer of fixed-size messages in named shared memory (shm_open),
+// for passing messages between processes. Any number of threads or
+// processes may push, and one thread of one process pops, reading each
+// message in place. Slots carry sequence numbers, as in BoundedQueue.
+// A popping thread can sleep on a futex in the shared memory until
+// a message is pushed. Only supported on Linux.
+//
+// The creating process owns the ring, and unlinks it when destroyed.
+// Another process opens it by name, and keeps its mapping even after the
+// owner exits, so should check stale() to find out if the owner has since
+// gone or been restarted with a new ring.
+
+class ShmRing {
+public:
+    // Replaces any ring left under the name by a previous run. Returns
+    // null if the shared memory couldn't be created.
+    static std::unique_ptr<ShmRing> create(const std::string& name, size_t capacity, size_t message_size);
+    // Returns null if the ring doesn't exist (or isn't initialised) yet,
+    // or holds messages of a different size.
+    static std::unique_ptr<ShmRing> open(const std::string& name, size_t message_size);
+    ~ShmRing();
+
+    ShmRing(const ShmRing&) = delete;
+    ShmRing& operator=(const ShmRing&) = delete;
+
+    // Copies message_size bytes into the next slot, or returns false if
+    // the ring is full.
+    bool try_push(const void* data);
+
+    // The next message, or null if there is none. Stays valid until
+    // pop(), so can be read without copying. Only one thread may pop.
+    const void* front();
+    void pop();
+
+    // Sleeps until a message may have been pushed, or the timeout (in
+    // seconds) expires. Returns false on timeout.
+    bool wait(double timeout);
+
+    bool stale() const;
+    size_t capacity() const;
+
+private:
+    struct Header;
+    static size_t slots_offset();
+    ShmRing(const std::string& name, void* memory, size_t size, uint64_t inode, bool owner);
+    void* slot(uint64_t pos) const;
+
+    const std::string name;
+    void* memory;
+    const size_t size;
+    const uint64_t inode;
+    const bool owner;
+    Header* header;
+};
+
+// Messages are copied into shared memory byte for byte, without any
+// serialisation, so must be trivially copyable and contain no pointers
+// (eg: fixed-size arrays rather than std::vector or std::string).
+template <typename T>
+constexpr bool shm_compatible = std::is_trivially_copyable_v<T> && alignof(T) <= 16;
+
+// Connect an Output to this in one process, and the messages are written
+// to the ShmReader of the same name in another. Writes never block on the
+// other process: if the ring is full, the message is dropped.
+template <typename T>
+class ShmWriter: public Input<T> {
+    static_assert(shm_compatible<T>, "Shared memory messages must be trivially copyable");
+public:
+    ShmWriter(const std::string& name, size_t capacity = 1024):
+        ring(ShmRing::create(name, capacity, sizeof(T))),
+        dropped_count(0)
+    {}
+
+    // False if the shared memory couldn't be created
+    bool valid() const { return static_cast<bool>(ring); }
+    size_t dropped() const { return dropped_count; }
+
+private:
+    void write(const T& data) override
+    {
+        if (!ring || !ring->try_push(&data)) {
+            dropped_count++;
+        }
+    }
+
+    std::unique_ptr<ShmRing> ring;
+    std::atomic<size_t> dropped_count;
+};
+
+// Writes the messages from the ShmWriter of the same name to the inputs
+// connected to it, from a poll callback which sleeps while the ring is
+// empty. Each message is passed to the inputs straight from shared
+// memory, so isn't copied unless an input keeps it. Waits for the writer
+// to create the ring, and re-opens it if the writer is restarted.
+template <typename T>
+class ShmReader: public Output<T> {
+    static_assert(shm_compatible<T>, "Shared memory messages must be trivially copyable");
+public:
+    ShmReader(Engine& engine, const std::string& name, double poll_timeout = 10e-3, size_t max_batch = 64):
+        name(name),
+        poll_timeout(poll_timeout),
+        max_batch(max_batch)
+    {
+        engine.create_poll_callback([this]() { return poll(); }, "shm:" + name);
+    }
+
+    void write(const T& value) override
+    {
+        this->write_value(value);
+    }
+
+private:
+    bool poll()
+    {
+        if (!ring) {
+            ring = ShmRing::open(name, sizeof(T));
+            if (!ring) {
+                std::this_thread::sleep_for(std::chrono::duration<double>(poll_timeout));
+                return true;
+            }
+        }
+        for (size_t i = 0; i < max_batch; i++) {
+            const void* data = ring->front();
+            if (!data) break;
+            this->write_value(*static_cast<const T*>(data));
+            ring->pop();
+        }
+        if (!ring->front() && !ring->wait(poll_timeout) && ring->stale()) {
+            ring.reset();
+        }
+        return true;
+    }
+
+    const std::string name;
+    const double poll_timeout;
+    const size_t max_batch;
+    std::unique_ptr<ShmRing> ring;
+};
+
+} // namespace flow
@@ -8,7 +8,15 @@
 #include <mutex>
 #include <unordered_map>
 #include <optional>
+#include <memory>
+#include <deque>
+#include <algorithm>
+#include <type_traits>
 #include "flow/engine.h"
+#include "flow/epoch.h"
+#include "flow/callback_group.h"
+#include "flow/bounded_queue.h"
+#include "flow/seqlock.h"
 
 namespace flow {
 
@@ -20,10 +28,23 @@ public:
     virtual ~InputBase() {}
 };
 
+// Messages can be written by reference, in which case each input that
+// keeps the message makes its own copy, by rvalue reference, in which case
+// the last input can take the message, or as a shared pointer to an
+// immutable message, which every input shares without copying.
+
 template <typename T>
 class Input: public InputBase {
 private:
     virtual void write(const T& value) = 0;
+    virtual void write(T&& value)
+    {
+        write(static_cast<const T&>(value));
+    }
+    virtual void write(const std::shared_ptr<const T>& value)
+    {
+        write(*value);
+    }
 
     template <typename T_>
     friend class Output;
@@ -33,27 +54,182 @@ template <typename T>
 class Output {
 public:
     virtual void write(const T& value) = 0;
+    virtual void write(T&& value)
+    {
+        write(static_cast<const T&>(value));
+    }
+    virtual void write(const std::shared_ptr<const T>& value)
+    {
+        write(*value);
+    }
+
+    template <typename... Args>
+    void emplace(Args&&... args)
+    {
+        write(T(std::forward<Args>(args)...));
+    }
+
+    // A message lent out by loan() to be filled in place. It is moved into
+    // the output on commit(), or discarded if never committed. Moving a
+    // loan moves the right to commit, so the message is written at most
+    // once.
+    class Loan {
+    public:
+        T& operator*() { return value; }
+        T* operator->() { return &value; }
+
+        // Does nothing if already committed, or moved from
+        void commit()
+        {
+            if (!output) return;
+            output->write(std::move(value));
+            output = nullptr;
+        }
+
+        Loan(Loan&& other):
+            output(other.output),
+            value(std::move(other.value))
+        {
+            other.output = nullptr;
+        }
+        Loan& operator=(Loan&& other)
+        {
+            if (this != &other) {
+                output = other.output;
+                value = std::move(other.value);
+                other.output = nullptr;
+            }
+            return *this;
+        }
+    private:
+        template <typename... Args>
+        Loan(Output* output, Args&&... args):
+            output(output),
+            value(std::forward<Args>(args)...)
+        {}
+        Output* output;
+        T value;
+        friend class Output;
+    };
+
+    template <typename... Args>
+    Loan loan(Args&&... args)
+    {
+        return Loan(this, std::forward<Args>(args)...);
+    }
+
+    // Names the output's writes in traces, which are otherwise all named
+    // "Output::write". Set before the engine runs.
+    void set_name(const std::string& name)
+    {
+        trace_name = intern_trace_name(name);
+    }
+
+    // Waits for writes which started before the last connect or
+    // disconnect to finish, so an input removed before then no longer
+    // receives messages and can be destroyed. Writes running on the
+    // calling thread, eg: if called from an input's callback, aren't
+    // waited for.
+    void synchronize()
+    {
+        uint64_t epoch;
+        {
+            std::scoped_lock<std::mutex> lock(inputs_mutex);
+            epoch = retired_epoch;
+        }
+        if (epoch != 0) epoch_synchronize(epoch);
+    }
+
 protected:
     void write_value(const T& value)
     {
-        std::scoped_lock<std::mutex> lock(inputs_mutex);
-        for (int i = 0; i < inputs.size(); i++) {
+        TraceScope scope(trace_name, true);
+        EpochReadSection section;
+        const inputs_t& inputs = *this->inputs.load(std::memory_order_acquire);
+        for (size_t i = 0; i < inputs.size(); i++) {
+            inputs[i]->write(value);
+        }
+    }
+    void write_value(T&& value)
+    {
+        TraceScope scope(trace_name, true);
+        EpochReadSection section;
+        const inputs_t& inputs = *this->inputs.load(std::memory_order_acquire);
+        if (inputs.empty()) return;
+        for (size_t i = 0; i + 1 < inputs.size(); i++) {
+            inputs[i]->write(static_cast<const T&>(value));
+        }
+        inputs.back()->write(std::move(value));
+    }
+    void write_value(const std::shared_ptr<const T>& value)
+    {
+        TraceScope scope(trace_name, true);
+        EpochReadSection section;
+        const inputs_t& inputs = *this->inputs.load(std::memory_order_acquire);
+        for (size_t i = 0; i < inputs.size(); i++) {
             inputs[i]->write(value);
         }
     }
 
+    Output():
+        current(std::make_unique<inputs_t>()),
+        retired_epoch(0),
+        trace_name("Output::write")
+    {
+        inputs = current.get();
+    }
+
 private:
+    typedef std::vector<Input<T>*> inputs_t;
+
     void add_input(Input<T>& input)
     {
         std::scoped_lock<std::mutex> lock(inputs_mutex);
-        inputs.push_back(&input);
+        auto next = std::make_unique<inputs_t>(*current);
+        next->push_back(&input);
+        publish(std::move(next));
+    }
+
+    void remove_input(Input<T>& input)
+    {
+        std::scoped_lock<std::mutex> lock(inputs_mutex);
+        auto next = std::make_unique<inputs_t>(*current);
+        next->erase(std::remove(next->begin(), next->end(), &input), next->end());
+        publish(std::move(next));
+    }
+
+    void publish(std::unique_ptr<inputs_t>&& next)
+    {
+        inputs = next.get();
+        retired_epoch = epoch_retire();
+        retired.emplace_back(retired_epoch, std::move(current));
+        current = std::move(next);
+
+        // Anything still retired is freed by a later call, so connecting
+        // never waits for a write
+        uint64_t oldest = epoch_oldest_reader();
+        auto end = std::find_if(retired.begin(), retired.end(),
+            [oldest](const auto& entry) { return entry.first >= oldest; });
+        retired.erase(retired.begin(), end);
     }
 
-    std::vector<Input<T>*> inputs;
+    // Writes iterate over an immutable snapshot of the inputs without
+    // locking, inside an epoch read section. Connecting or disconnecting
+    // publishes a new snapshot, and retires the old one until no write can
+    // still be using it. disconnect() waits for writes using the old
+    // snapshot, through synchronize().
+    std::atomic<const inputs_t*> inputs;
+    std::unique_ptr<const inputs_t> current;
+    std::vector<std::pair<uint64_t, std::unique_ptr<const inputs_t>>> retired;
+    uint64_t retired_epoch;
     std::mutex inputs_mutex;
 
+    const char* trace_name;
+
     template <typename T_>
     friend void connect(Output<T_>& out, Input<T_>& in);
+    template <typename T_>
+    friend void disconnect(Output<T_>& out, Input<T_>& in);
 };
 
 template <typename T>
@@ -63,6 +239,14 @@ public:
     {
         this->write_value(value);
     }
+    void write(T&& value) override
+    {
+        this->write_value(std::move(value));
+    }
+    void write(const std::shared_ptr<const T>& value) override
+    {
+        this->write_value(value);
+    }
 };
 
 template <typename T>
@@ -72,192 +256,372 @@ public:
         engine.create_timer_callback(period, std::bind(&TimedOutput::write_callback, this));
     }
     void write(const T& value) override {
+        std::scoped_lock<std::mutex> lock(mutex);
+        latest = value;
+        this->value.reset();
+    }
+    void write(T&& value) override {
+        std::scoped_lock<std::mutex> lock(mutex);
+        latest = std::move(value);
+        this->value.reset();
+    }
+    void write(const std::shared_ptr<const T>& value) override {
         std::scoped_lock<std::mutex> lock(mutex);
         this->value = value;
     }
 private:
+    // A message written by reference is only wrapped in a shared pointer
+    // when the timer first publishes it, so writing faster than the period
+    // doesn't allocate for messages which are never published.
     void write_callback() {
+        std::shared_ptr<const T> value;
+        {
+            std::scoped_lock<std::mutex> lock(mutex);
+            if (!this->value && latest.has_value()) {
+                this->value = std::make_shared<const T>(*latest);
+            }
+            value = this->value;
+        }
+        if (!value) return;
+        this->write_value(value);
+    }
+    // The latest message written by reference, kept so its storage is
+    // reused, and the message to publish, which is null if latest is newer
+    std::optional<T> latest;
+    std::shared_ptr<const T> value;
+    std::mutex mutex;
+};
+
+// The latest of a series of shared messages. Readers take a reference to
+// it inside an epoch read section, without locking. Writers take a mutex
+// among themselves, and retire the node holding the previous message,
+// which is reused once no reader can still be using it. Retired nodes are
+// reclaimed in batches, since that makes a membarrier syscall, so up to
+// reclaim_batch earlier messages may be kept alive until then.
+template <typename T>
+class EpochSharedPtr {
+public:
+    EpochSharedPtr():
+        published(nullptr)
+    {}
+    EpochSharedPtr(const EpochSharedPtr&) = delete;
+    EpochSharedPtr& operator=(const EpochSharedPtr&) = delete;
+
+    std::shared_ptr<const T> load() const
+    {
+        EpochReadSection section;
+        const Node* node = published.load(std::memory_order_acquire);
+        return node ? node->value : nullptr;
+    }
+
+    void store(std::shared_ptr<const T> value)
+    {
         std::scoped_lock<std::mutex> lock(mutex);
-        if (!value.has_value()) return;
-        this->write_value(value.value());
+        std::unique_ptr<Node> node;
+        if (free_nodes.empty()) {
+            node = std::make_unique<Node>();
+        } else {
+            node = std::move(free_nodes.back());
+            free_nodes.pop_back();
+        }
+        node->value = std::move(value);
+        published.store(node.get(), std::memory_order_release);
+        if (current) {
+            retired.emplace_back(epoch_retire(), std::move(current));
+        }
+        current = std::move(node);
+        if (retired.size() >= reclaim_batch) {
+            reclaim();
+        }
     }
-    std::optional<T> value;
+
+private:
+    static constexpr size_t reclaim_batch = 16;
+
+    struct Node {
+        std::shared_ptr<const T> value;
+    };
+
+    void reclaim()
+    {
+        uint64_t oldest = epoch_oldest_reader();
+        auto end = std::find_if(retired.begin(), retired.end(),
+            [oldest](const auto& entry) { return entry.first >= oldest; });
+        for (auto iter = retired.begin(); iter != end; iter++) {
+            iter->second->value.reset();
+            free_nodes.push_back(std::move(iter->second));
+        }
+        retired.erase(retired.begin(), end);
+    }
+
+    std::atomic<const Node*> published;
+    std::unique_ptr<Node> current;
+    std::vector<std::pair<uint64_t, std::unique_ptr<Node>>> retired;
+    std::vector<std::unique_ptr<Node>> free_nodes;
     std::mutex mutex;
 };
 
+// Keeps the latest message, which readers can get at any time, without
+// locking or waiting for writers. Small trivially copyable messages are
+// kept in a seqlock and copied out by readers, so readers and writers
+// never wait for each other. Other messages are shared, and kept in an
+// EpochSharedPtr, which readers take a reference to. Writers of those
+// take a mutex among themselves (never held while copying the message).
+
 template <typename T>
 class SampledInput: public Input<T> {
+    static constexpr bool use_seqlock = std::is_trivially_copyable_v<T> && sizeof(T) <= 64;
+
 public:
     typedef std::function<void(const T&)> callback_t;
     SampledInput(Engine& engine, const std::optional<callback_t>& callback = std::nullopt):
         engine(engine),
-        callback(callback),
-        read_cached(true),
-        value_received(false)
+        callback(callback)
     {}
     SampledInput(Engine& engine, const T& default_value, const std::optional<callback_t>& callback = std::nullopt):
         engine(engine),
-        callback(callback),
-        read_cached(true),
-        value_received(true)
+        callback(callback)
     {
-        cached = default_value;
+        store(default_value);
     }
 
+    // Holds the message that was latest when get() was called, which
+    // later writes don't modify.
     class Pointer {
     public:
         const T& operator*()const
         {
-            return reading_cached ? parent->cached : parent->other;
+            return *value;
         }
         const T* operator->()const
         {
-            return reading_cached ? &parent->cached : &parent->other;
+            return &*value;
         }
-        operator bool()const { return parent != nullptr; }
+        operator bool()const { return static_cast<bool>(value); }
 
-        Pointer(Pointer&& other) = default;
-        ~Pointer()
+        // Shares ownership of the message, so it can be kept after the
+        // pointer is released. Copies the message if it was held in
+        // a seqlock.
+        std::shared_ptr<const T> borrow()const
         {
-            if (!parent) return;
-            std::scoped_lock<std::mutex> lock(parent->mutex);
-            if (reading_cached) {
-                parent->reading_cached = false;
+            if constexpr (use_seqlock) {
+                if (!value) return nullptr;
+                return std::make_shared<const T>(*value);
             } else {
-                parent->reading_other = false;
+                return value;
             }
         }
+
+        Pointer(Pointer&& other) = default;
     private:
-        Pointer(const SampledInput* parent = nullptr, bool reading_cached = true):
-            parent(parent),
-            reading_cached(reading_cached)
+        typedef std::conditional_t<use_seqlock, std::optional<T>, std::shared_ptr<const T>> value_t;
+        Pointer(const value_t& value):
+            value(value)
         {}
-        const SampledInput* parent;
-        bool reading_cached;
+        value_t value;
         friend class SampledInput;
     };
 
     Pointer get()const
     {
-        std::scoped_lock<std::mutex> lock(mutex);
-        if (!value_received) return Pointer();
-
-        if (read_cached) {
-            reading_cached = true;
-            return Pointer(this, true);
-        } else {
-            reading_other = true;
-            return Pointer(this, false);
-        }
+        return Pointer(latest.load());
     }
 
 private:
     void write(const T& data) override
     {
-        bool write_cached;
-        mutex.lock();
-        if (!reading_cached && !reading_other) {
-            write_cached = !read_cached;
-        } else if (!reading_cached) {
-            write_cached = true;
-        } else { // !reading_other
-            write_cached = false;
+        if constexpr (use_seqlock) {
+            store(data);
+            if (callback.has_value()) {
+                callback.value()(data);
+            }
+        } else {
+            write(std::make_shared<const T>(data));
         }
-        mutex.unlock();
+    }
 
-        if (write_cached) {
-            cached = data;
+    void write(T&& data) override
+    {
+        if constexpr (use_seqlock) {
+            write(static_cast<const T&>(data));
         } else {
-            other = data;
+            write(std::make_shared<const T>(std::move(data)));
         }
+    }
 
-        mutex.lock();
-        read_cached = write_cached;
-        value_received = true;
-        if (callback.has_value()) {
-            if (read_cached) {
-                callback.value()(cached);
-            } else {
-                callback.value()(other);
+    void write(const std::shared_ptr<const T>& data) override
+    {
+        if constexpr (use_seqlock) {
+            write(*data);
+        } else {
+            latest.store(data);
+            if (callback.has_value()) {
+                callback.value()(*data);
             }
         }
-        mutex.unlock();
+    }
+
+    void store(const T& data)
+    {
+        if constexpr (use_seqlock) {
+            latest.store(std::optional<T>(data));
+        } else {
+            latest.store(std::make_shared<const T>(data));
+        }
     }
 
     // TODO: Remove engine, unused
     Engine& engine;
     std::optional<callback_t> callback;
 
-    T cached;
-    T other;
-    mutable std::mutex mutex;
-    mutable std::mutex other_mutex;
-    mutable bool read_cached;
-    mutable bool reading_cached;
-    mutable bool reading_other;
-    bool value_received;
+    std::conditional_t<use_seqlock,
+        SeqLock<std::optional<T>>,
+        EpochSharedPtr<T>> latest;
+};
+
+// What CallbackInput::write does when the queue is full:
+// - DropOldest: Discard the oldest queued message to make room.
+// - DropNewest: Discard the message being written.
+// - Block: Park the writing thread until the callback takes a message.
+//   If every callback thread is blocked writing, this will deadlock.
+// - Grow: Queue the message in an unbounded overflow list, which is
+//   mutex-guarded, so only use this if overflowing is rare.
+enum class OverflowPolicy {
+    DropOldest,
+    DropNewest,
+    Block,
+    Grow
 };
 
 template <typename T>
 class CallbackInput: public Input<T> {
+    // A message written by reference is copied into value, a shared
+    // message is kept in shared.
+    struct Slot {
+        T value;
+        std::shared_ptr<const T> shared;
+
+        Slot() = default;
+        Slot(Slot&&) = default;
+        Slot& operator=(Slot&&) = default;
+        template <typename U>
+        Slot(U&& data) { *this = std::forward<U>(data); }
+
+        Slot& operator=(const T& data) { value = data; shared.reset(); return *this; }
+        Slot& operator=(T&& data) { value = std::move(data); shared.reset(); return *this; }
+        Slot& operator=(const std::shared_ptr<const T>& data) { shared = data; return *this; }
+
+        const T& get() const { return shared ? *shared : value; }
+    };
+
 public:
     typedef std::function<void(const T&)> callback_t;
+
+    // Messages are passed to the callback one at a time, never
+    // concurrently, in the order they were queued. Up to max_batch
+    // messages are handled per callback pushed to the engine.
+    // queue_size is rounded up to a power of two (so the default holds 16
+    // messages), and the overflow policy applies once that many are
+    // queued. See capacity().
     CallbackInput(
         Engine& engine,
         const callback_t& callback,
-        size_t queue_size = 10
+        size_t queue_size = 10,
+        OverflowPolicy overflow = OverflowPolicy::Block,
+        size_t max_batch = 16
     ):
         engine(engine),
         callback(callback),
-        front(0),
-        back(0),
-        full(false)
+        overflow(overflow),
+        max_batch(max_batch == 0 ? 1 : max_batch),
+        queue(queue_size),
+        queued(0),
+        waiting(0),
+        scheduled(false),
+        overflow_count(0),
+        dropped_count(0),
+        high_water(0),
+        id(nullptr),
+        priority(Priority::Normal),
+        group(nullptr)
+    {}
+
+    // Names the callback for engine instrumentation and tracing, where each batch of
+    // messages counts as one invocation.
+    void set_name(const std::string& name)
+    {
+        id = engine.register_callback(name);
+    }
+
+    // Priority of the callbacks this input pushes to the engine
+    void set_priority(Priority priority)
     {
-        queue.resize(queue_size);
+        this->priority = priority;
+    }
+
+    // Runs the callback in the given group instead, so that it is
+    // serialized with the group's other callbacks. The group's name and
+    // priority are used in place of the input's.
+    void set_group(CallbackGroup& group)
+    {
+        this->group = &group;
     }
 
     class Pointer {
     public:
         const T& operator*()const
         {
-            return parent->queue[parent->front];
+            return slot.get();
         }
         const T* operator->()const
         {
-            return &parent->queue[parent->front];
+            return &slot.get();
         }
         operator bool()const
         {
-            return parent != nullptr;
+            return valid;
         }
-        ~Pointer()
-        {
-            if (!parent) return;
 
-            std::scoped_lock<std::mutex> lock(parent->position_mutex);
-            parent->mutex.unlock();
-
-            parent->full = false;
-            parent->front = (parent->front + 1) % parent->queue.size();
+        // Shares ownership of the message, so it can be kept after the
+        // pointer is released. If the message was written by reference,
+        // it is moved (not copied) out of the pointer into a shared pointer.
+        std::shared_ptr<const T> borrow()const
+        {
+            if (!slot.shared) {
+                slot.shared = std::make_shared<const T>(std::move(slot.value));
+            }
+            return slot.shared;
         }
+
         Pointer(Pointer&& other) = default;
     private:
-        Pointer(const CallbackInput* parent = nullptr):
-            parent(parent)
-        {}
-        const CallbackInput* parent;
+        Pointer(): valid(false) {}
+        Pointer(Slot&& slot): slot(std::move(slot)), valid(true) {}
+        mutable Slot slot;
+        bool valid;
         friend class CallbackInput;
     };
 
+    // Takes the next message off the queue. Only call this from the
+    // callback, since messages are otherwise taken by the engine.
     Pointer get()const
     {
-        mutex.lock();
-        std::scoped_lock<std::mutex> lock(position_mutex);
-        if (!full && front == back) {
-            mutex.unlock();
-            return Pointer();
+        Slot slot;
+        if (queue.try_pop(slot)) {
+            release();
+            return Pointer(std::move(slot));
         }
-        return Pointer(this);
+        if (overflow_count > 0) {
+            std::scoped_lock<std::mutex> lock(overflow_mutex);
+            if (!overflow_queue.empty()) {
+                slot = std::move(overflow_queue.front());
+                overflow_queue.pop_front();
+                overflow_count--;
+                release();
+                return Pointer(std::move(slot));
+            }
+        }
+        return Pointer();
     }
 
     static Pointer null_pointer()
@@ -265,38 +629,146 @@ public:
         return Pointer();
     }
 
+    size_t size() const { return queued; }
+    // Messages the queue holds before overflowing, which is queue_size
+    // rounded up to a power of two
+    size_t capacity() const { return queue.capacity(); }
+    size_t dropped() const { return dropped_count; }
+    size_t high_water_mark() const { return high_water; }
+
 private:
     void write(const T& data) override
     {
-        std::scoped_lock<std::mutex> lock(position_mutex);
-        while (full);
-        queue[back] = data;
-        back = (back + 1) % queue.size();
-        full = (back == front);
-        engine.push_callback(std::bind(&CallbackInput::process, this));
+        write_slot(data);
+    }
+
+    void write(T&& data) override
+    {
+        write_slot(std::move(data));
+    }
+
+    void write(const std::shared_ptr<const T>& data) override
+    {
+        write_slot(data);
+    }
+
+    template <typename U>
+    void write_slot(U&& data)
+    {
+        TraceScope scope(id ? id->name.c_str() : "CallbackInput::write");
+        queued++;
+        if (!push(std::forward<U>(data))) {
+            queued--;
+            dropped_count++;
+            return;
+        }
+
+        size_t size = queued;
+        size_t high = high_water;
+        while (size > high && !high_water.compare_exchange_weak(high, size)) {}
+
+        schedule();
+    }
+
+    template <typename U>
+    bool push(U&& data)
+    {
+        switch (overflow) {
+        case OverflowPolicy::DropNewest:
+            return queue.try_push(std::forward<U>(data));
+        case OverflowPolicy::DropOldest:
+            while (!queue.try_push(std::forward<U>(data))) {
+                Slot oldest;
+                if (queue.try_pop(oldest)) {
+                    release();
+                    dropped_count++;
+                }
+            }
+            return true;
+        case OverflowPolicy::Block:
+            while (true) {
+                size_t seen = queued;
+                if (queue.try_push(std::forward<U>(data))) break;
+                waiting++;
+                queued.wait(seen);
+                waiting--;
+            }
+            return true;
+        case OverflowPolicy::Grow:
+            if (overflow_count == 0 && queue.try_push(std::forward<U>(data))) {
+                return true;
+            }
+            {
+                std::scoped_lock<std::mutex> lock(overflow_mutex);
+                overflow_queue.emplace_back(std::forward<U>(data));
+                overflow_count++;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void release()const
+    {
+        queued--;
+        if (waiting > 0) {
+            queued.notify_all();
+        }
+    }
+
+    void schedule()
+    {
+        if (!scheduled.exchange(true)) {
+            if (group) {
+                group->push_callback([this]() { process(); });
+            } else {
+                engine.push_callback(id, [this]() { process(); }, priority);
+            }
+        }
     }
 
     void process()
     {
-        auto data = get();
-        callback(*data);
+        for (size_t i = 0; i < max_batch; i++) {
+            auto data = get();
+            if (!data) break;
+            callback(*data);
+        }
+        // A writer that saw scheduled == true before this point has
+        // already incremented queued, so its message isn't missed.
+        scheduled = false;
+        if (queued > 0) {
+            schedule();
+        }
     }
 
     Engine& engine;
     callback_t callback;
+    const OverflowPolicy overflow;
+    const size_t max_batch;
+
+    mutable BoundedQueue<Slot> queue;
+    mutable std::atomic<size_t> queued;
+    std::atomic<size_t> waiting;
+    std::atomic<bool> scheduled;
+
+    mutable std::deque<Slot> overflow_queue;
+    mutable std::mutex overflow_mutex;
+    mutable std::atomic<size_t> overflow_count;
 
-    std::vector<T> queue;
-    mutable size_t front, back;
-    mutable std::mutex position_mutex;
-    mutable std::atomic<bool> full;
-    mutable std::mutex mutex;
+    std::atomic<size_t> dropped_count;
+    std::atomic<size_t> high_water;
+
+    Engine::CallbackId id;
+    Priority priority;
+    CallbackGroup* group;
 };
 
 template <typename T>
 class DirectInput: public Input<T> {
 public:
     typedef std::function<void(const T&)> callback_t;
-    DirectInput(Engine& engine, const callback_t& callback):
+    DirectInput(Engine&, const callback_t& callback):
         callback(callback)
     {}
 
@@ -315,4 +787,13 @@ void connect(Output<T>& out, Input<T>& in)
     out.add_input(in);
 }
 
+// Once this returns, the input receives no more messages from the output
+// (except from a write running on the calling thread), so may be destroyed
+template <typename T>
+void disconnect(Output<T>& out, Input<T>& in)
+{
+    out.remove_input(in);
+    out.synchronize();
+}
+
 } // namespace flow
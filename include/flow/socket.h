@@ -0,0 +1,213 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "flow/engine.h"
+#include "flow/serialize.h"
+#include "flow/service.h"
+#include "flow/signal.h"
+
+
+namespace flow {
+
+enum class SocketRole {
+    Listen,
+    Connect
+};
+
+// Connects the engine to an engine in another process (or host) over a
+// Unix domain socket or TCP, with an address of the form
+// "unix:/path/to/socket" or "tcp:host:port". One end listens and the other
+// connects, and both reconnect if the connection is lost. Only supported
+// on Linux.
+//
+// Messages are sent on numbered channels, so one connection carries any
+// number of signals in each direction: a SocketWriter on one end sends to
+// the SocketReaders with the same channel on the other. Each message is
+// serialized into a pooled buffer, and messages sent while another thread
+// is already writing to the socket are queued, then all written in the
+// next call to sendmsg, so small messages are batched under load. The
+// writing thread returns after a few batches, leaving the rest to the next
+// sender, or the poll callback. Messages sent while disconnected, or while
+// too many are queued (such as if the peer stalls), are dropped.
+//
+// Create the readers before calling run(). Their messages are written from
+// the bridge's poll callback.
+
+class SocketBridge {
+public:
+    SocketBridge(Engine& engine, const std::string& address, SocketRole role, const std::string& name = "socket");
+    ~SocketBridge();
+    SocketBridge(const SocketBridge&) = delete;
+    SocketBridge& operator=(const SocketBridge&) = delete;
+
+    bool connected() const { return fd_connected; }
+    // Messages dropped while disconnected, on a write error, for being too
+    // large, or for the send queue being full
+    size_t dropped() const { return dropped_count; }
+    // Messages sent, and the calls to sendmsg they took
+    size_t sent() const { return sent_count; }
+    size_t send_calls() const { return send_call_count; }
+
+    typedef std::vector<uint8_t> buffer_t;
+    // A buffer with room for a message of the given size, to fill in
+    // after the first header_size bytes and pass to send(). Messages
+    // larger than max_message_size are dropped, and get an empty buffer.
+    buffer_t acquire_buffer(uint32_t channel, size_t size);
+    void send(buffer_t&& buffer);
+    static constexpr size_t header_size = 8;
+    // Larger frames are treated as a corrupt stream by the receiver
+    static constexpr size_t max_message_size = 1 << 30;
+
+    typedef std::function<void(const uint8_t* data, size_t size)> handler_t;
+    void add_handler(uint32_t channel, const handler_t& handler);
+
+private:
+    bool poll();
+    bool open_connection();
+    void close_connection();
+    bool receive();
+    void write_queued(std::unique_lock<std::mutex>& lock, size_t max_batches);
+    void flush_queued();
+    bool write_buffers(int out, std::vector<buffer_t>& buffers);
+    void release_buffers(std::vector<buffer_t>& buffers);
+
+    const std::string address;
+    const SocketRole role;
+    int listen_fd;
+    int fd;
+    std::atomic<bool> fd_connected;
+
+    // Guards fd (which only the poll thread changes) and the buffers.
+    // The thread which finds no send in progress writes the queued
+    // buffers, so other sending threads never wait for it.
+    std::mutex send_mutex;
+    std::condition_variable send_cv;
+    bool sending;
+    std::vector<buffer_t> queued;
+    std::vector<buffer_t> writing;
+    std::vector<buffer_t> free_buffers;
+
+    std::mutex handlers_mutex;
+    // Replaced rather than modified when a handler is added, so the poll
+    // thread can call a channel's handlers without holding the lock
+    typedef std::vector<handler_t> handlers_t;
+    std::unordered_map<uint32_t, std::shared_ptr<const handlers_t>> handlers;
+    std::vector<uint8_t> receive_buffer;
+    size_t receive_size;
+
+    std::atomic<size_t> dropped_count;
+    std::atomic<size_t> sent_count;
+    std::atomic<size_t> send_call_count;
+};
+
+// Sends the messages written to it over the bridge
+template <typename T>
+class SocketWriter: public Input<T> {
+public:
+    SocketWriter(SocketBridge& bridge, uint32_t channel):
+        bridge(bridge),
+        channel(channel)
+    {}
+
+private:
+    void write(const T& data) override
+    {
+        size_t size = serialized_size(data);
+        SocketBridge::buffer_t buffer = bridge.acquire_buffer(channel, size);
+        if (buffer.empty()) return;
+        serialize(data, buffer.data() + SocketBridge::header_size);
+        bridge.send(std::move(buffer));
+    }
+
+    SocketBridge& bridge;
+    const uint32_t channel;
+};
+
+// Writes the messages received over the bridge to its inputs. Messages
+// which fail to deserialize are dropped.
+template <typename T>
+class SocketReader: public Output<T> {
+public:
+    SocketReader(SocketBridge& bridge, uint32_t channel):
+        invalid_count(0)
+    {
+        bridge.add_handler(channel, [this](const uint8_t* data, size_t size) {
+            T value;
+            if (!deserialize(value, data, size)) {
+                invalid_count++;
+                return;
+            }
+            this->write_value(std::move(value));
+        });
+    }
+
+    void write(const T& value) override
+    {
+        this->write_value(value);
+    }
+
+    size_t invalid() const { return invalid_count; }
+
+private:
+    std::atomic<size_t> invalid_count;
+};
+
+// Stands in for a server in the other process, which is connected to a
+// SocketServiceClient on the same channel there.
+template <typename Request, typename Response>
+class SocketServiceServer {
+public:
+    SocketServiceServer(SocketBridge& bridge, uint32_t channel):
+        in_request_(bridge, channel),
+        out_response_(bridge, channel)
+    {}
+
+    Input<ServiceMessage<Request>>& in_request() { return in_request_; }
+    Output<ServiceMessage<Response>>& out_response() { return out_response_; }
+
+private:
+    SocketWriter<ServiceMessage<Request>> in_request_;
+    SocketReader<ServiceMessage<Response>> out_response_;
+};
+
+// Stands in for the clients in the other process, which are connected to
+// a SocketServiceServer on the same channel there.
+template <typename Request, typename Response>
+class SocketServiceClient {
+public:
+    SocketServiceClient(SocketBridge& bridge, uint32_t channel):
+        out_request_(bridge, channel),
+        in_response_(bridge, channel)
+    {}
+
+    Output<ServiceMessage<Request>>& out_request() { return out_request_; }
+    Input<ServiceMessage<Response>>& in_response() { return in_response_; }
+
+private:
+    SocketReader<ServiceMessage<Request>> out_request_;
+    SocketWriter<ServiceMessage<Response>> in_response_;
+};
+
+template <typename Request, typename Response>
+void connect(ServiceClient<Request, Response>& client, SocketServiceServer<Request, Response>& server)
+{
+    connect(client.out_request(), server.in_request());
+    connect(server.out_response(), client.in_response());
+}
+
+template <typename Request, typename Response>
+void connect(SocketServiceClient<Request, Response>& client, ServiceServer<Request, Response>& server)
+{
+    connect(client.out_request(), server.in_request());
+    connect(server.out_response(), client.in_response());
+}
+
+} // namespace flow
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "flow/time.h"
+
+
+namespace flow {
+
+// Snapshot of a distribution of durations (or other counts), bucketed by
+// powers of two: bucket i holds values in [2^(i-1), 2^i), bucket 0 holds
+// zero, and the last bucket holds everything larger.
+struct Histogram {
+    static constexpr size_t num_buckets = 32;
+
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+    std::array<uint64_t, num_buckets> buckets = {};
+
+    static size_t bucket(uint64_t value);
+
+    double mean() const;
+    // Upper bound of the bucket containing the given percentile (0 to 1),
+    // so accurate to within a factor of two.
+    uint64_t percentile(double p) const;
+    void merge(const Histogram& other);
+};
+
+// Durations are in nanoseconds. The wait is the time from a callback being
+// pushed until it started, and the lateness is how far past its deadline
+// a timer fired (in engine time). Poll callbacks only record execution,
+// with one invocation per call to poll.
+struct CallbackStats {
+    std::string name;
+    Histogram wait;
+    Histogram execution;
+    Histogram lateness;
+
+    uint64_t invocations() const { return execution.count; }
+};
+
+// Queue depth is sampled on every push, so call Engine::get_stats()
+// periodically and compare snapshots to see how it changes over time.
+struct EngineStats {
+    TimePoint time;
+    std::vector<CallbackStats> callbacks;
+    size_t queue_depth;
+    Histogram queue_depth_samples;
+};
+
+// Histogram which is recorded into concurrently. The counters are split
+// into shards, and each thread records into its own shard, so threads
+// don't contend on the same cache lines. Reading sums the shards.
+class ShardedHistogram {
+public:
+    ShardedHistogram();
+    ShardedHistogram(const ShardedHistogram&) = delete;
+    ShardedHistogram& operator=(const ShardedHistogram&) = delete;
+
+    void record(uint64_t value);
+    Histogram load() const;
+
+private:
+    static constexpr size_t num_shards = 8;
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> total;
+        std::atomic<uint64_t> max;
+        std::atomic<uint64_t> buckets[Histogram::num_buckets];
+    };
+    Shard shards[num_shards];
+};
+
+// Counters for one named callback
+class CallbackCounters {
+public:
+    CallbackCounters(const std::string& name): name(name) {}
+
+    void record_wait(int64_t ns) { wait.record(ns > 0 ? ns : 0); }
+    void record_execution(int64_t ns) { execution.record(ns > 0 ? ns : 0); }
+    void record_lateness(int64_t ns) { lateness.record(ns > 0 ? ns : 0); }
+
+    CallbackStats load() const;
+
+    const std::string name;
+
+private:
+    ShardedHistogram wait;
+    ShardedHistogram execution;
+    ShardedHistogram lateness;
+};
+
+} // namespace flow
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+namespace flow {
+
+// Move-only type-erased void() callable, used for callbacks queued on the
+// engine. Callables that fit in the inline buffer (and can be moved without
+// throwing) are stored in place, so wrapping, queueing and executing them
+// never allocates. Larger callables fall back to the heap.
+
+class Task {
+public:
+    static constexpr size_t inline_size = 6 * sizeof(void*);
+
+    Task(): ops(nullptr) {}
+
+    template <typename F, typename = std::enable_if_t<
+        !std::is_same_v<std::decay_t<F>, Task> && std::is_invocable_v<std::decay_t<F>&>>>
+    Task(F&& f)
+    {
+        typedef std::decay_t<F> callable_t;
+        if constexpr (fits_inline<callable_t>()) {
+            new (storage) callable_t(std::forward<F>(f));
+            ops = &inline_ops<callable_t>;
+        } else {
+            new (storage) callable_t*(new callable_t(std::forward<F>(f)));
+            ops = &heap_ops<callable_t>;
+        }
+    }
+
+    Task(Task&& other) noexcept:
+        ops(other.ops)
+    {
+        if (ops) {
+            ops->move(other.storage, storage);
+            other.ops = nullptr;
+        }
+    }
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            ops = other.ops;
+            if (ops) {
+                ops->move(other.storage, storage);
+                other.ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { reset(); }
+
+    void operator()() { ops->invoke(storage); }
+    explicit operator bool() const { return ops != nullptr; }
+
+    void reset()
+    {
+        if (ops) {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        // Move constructs into to and destroys from
+        void (*move)(void* from, void* to);
+        void (*destroy)(void* storage);
+    };
+
+    template <typename F>
+    static constexpr bool fits_inline()
+    {
+        return sizeof(F) <= inline_size
+            && alignof(F) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<F>;
+    }
+
+    template <typename F>
+    static constexpr Ops inline_ops = {
+        [](void* storage) { (*static_cast<F*>(storage))(); },
+        [](void* from, void* to) {
+            new (to) F(std::move(*static_cast<F*>(from)));
+            static_cast<F*>(from)->~F();
+        },
+        [](void* storage) { static_cast<F*>(storage)->~F(); }
+    };
+
+    template <typename F>
+    static constexpr Ops heap_ops = {
+        [](void* storage) { (**static_cast<F**>(storage))(); },
+        [](void* from, void* to) { new (to) F*(*static_cast<F**>(from)); },
+        [](void* storage) { delete *static_cast<F**>(storage); }
+    };
+
+    alignas(std::max_align_t) unsigned char storage[inline_size];
+    const Ops* ops;
+};
+
+} // namespace flow
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace flow {
+
+// Scheduling of a group of engine threads. Only supported on Linux,
+// elsewhere threads are only left as they are.
+struct ThreadConfig {
+    // CPUs the threads may run on, or empty to leave them unpinned
+    std::vector<int> cpus;
+    // Pin each thread of the group to one of the cpus in turn, instead of
+    // letting every thread use all of them
+    bool pin_each = false;
+    // If above zero, run with the SCHED_FIFO policy at this priority (1 to
+    // 99), which usually needs CAP_SYS_NICE or an rtprio limit
+    int realtime_priority = 0;
+    // If the affinity or policy can't be set, fail the engine the same way
+    // as a failed init callback, instead of running without it
+    bool required = false;
+};
+
+// Names the thread (truncated to 15 characters) and applies the config,
+// where index is the thread's position in its group. Returns false if
+// the affinity or policy couldn't be set.
+bool configure_thread(
+    std::thread::native_handle_type handle,
+    const ThreadConfig& config,
+    const std::string& name,
+    size_t index);
+
+} // namespace flow
@@ -1,13 +1,15 @@
 #pragma once
 
 #include <cstdint>
+#include "flow/seqlock.h"
 
 
 namespace flow {
 
 // If using real time:
-// - Time = Elapsed time since start of program
-// - Timestamp = Unix timestamp (nanoseconds since epoch)
+// - Time = Elapsed time since start of program, from the monotonic clock
+// - Timestamp = Unix timestamp (nanoseconds since epoch) at the start, plus
+//   the elapsed time, so it doesn't jump if the system clock is adjusted
 // - Rate = 1
 // If using sim or data playback:
 // - Time = Elapsed system time since start of sim or playback (not same as real time)
@@ -20,9 +22,16 @@ struct TimePoint {
     double rate;
 
     static int64_t now_timestamp();
-    static TimePoint now(int64_t initial_timestamp);
 };
 
+// Monotonic clock in nanoseconds, which never jumps. On Linux this reads
+// CLOCK_MONOTONIC through the vDSO, so doesn't make a syscall.
+int64_t monotonic_ns();
+
+// A TimePoint which threads publish and any thread can read, without
+// locking, since readers never block the writer
+typedef SeqLock<TimePoint> AtomicTimePoint;
+
 struct Duration {
     double elapsed;
     int64_t elapsed_timestamp;
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "flow/stats.h"
+
+
+namespace flow {
+
+// Records trace events into a ring buffer per thread, which can be written
+// out as Chrome trace JSON (viewable in chrome://tracing or Perfetto).
+// Only threads which have attached to the tracer record events, so
+// recording never takes a lock and does nothing on other threads.
+// Once a buffer is full, the oldest events are overwritten.
+//
+// Event names are kept as pointers, so must outlive the tracer.
+// intern_trace_name() gives a name that does, for objects that may not.
+
+class Tracer {
+public:
+    Tracer(size_t buffer_size);
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // Gives the calling thread its own buffer, and records its events
+    // into it until detach() is called.
+    void attach(const std::string& thread_name);
+    static void detach();
+
+    // The tracer the calling thread is attached to, if any
+    static Tracer* current() { return current_tracer; }
+
+    // These record into the calling thread's buffer, so must only be
+    // called on the current() tracer.
+    void record_slice(const char* name, int64_t start, int64_t end);
+    // A flow is drawn as an arrow from the slice enclosing its start to the
+    // slice enclosing its end. Its start is tagged with the name of the
+    // innermost TraceScope on the thread that is a flow source, if any.
+    uint64_t record_flow_start();
+    void record_flow_end(uint64_t flow, int64_t time);
+
+    // May be called while other threads are recording, in which case
+    // events overwritten during the write are left out.
+    void write_json(std::ostream& os) const;
+
+private:
+    enum class EventType: char {
+        Slice,
+        FlowStart,
+        FlowEnd
+    };
+    // Fields are atomic so that writing out the buffer while it is being
+    // recorded into isn't a data race.
+    struct Event {
+        std::atomic<EventType> type;
+        std::atomic<const char*> name;
+        std::atomic<int64_t> start;
+        std::atomic<int64_t> end;
+        std::atomic<uint64_t> flow;
+    };
+    struct Buffer {
+        Buffer(size_t size, const std::string& thread_name);
+        void record(EventType type, const char* name, int64_t start, int64_t end, uint64_t flow);
+
+        const std::string thread_name;
+        std::unique_ptr<Event[]> events;
+        size_t mask;
+        std::atomic<size_t> next;
+    };
+
+    const size_t buffer_size;
+    const int64_t initial_time;
+    std::atomic<uint64_t> next_flow;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    mutable std::mutex buffers_mutex;
+
+    static thread_local Tracer* current_tracer;
+    static thread_local Buffer* current_buffer;
+    static thread_local const char* current_flow_source;
+    friend class TraceScope;
+};
+
+const char* intern_trace_name(const std::string& name);
+
+// Records a slice covering its lifetime, if the thread is attached to
+// a tracer. A flow source, such as an output's write, also tags the flows
+// started within it with its name.
+class TraceScope {
+public:
+    TraceScope(const char* name, bool flow_source = false):
+        tracer(Tracer::current()),
+        name(name),
+        start(0),
+        previous_source(nullptr),
+        flow_source(flow_source)
+    {
+        if (!tracer) return;
+        start = monotonic_ns();
+        if (flow_source) {
+            previous_source = Tracer::current_flow_source;
+            Tracer::current_flow_source = name;
+        }
+    }
+    ~TraceScope()
+    {
+        if (!tracer) return;
+        if (flow_source) Tracer::current_flow_source = previous_source;
+        tracer->record_slice(name, start, monotonic_ns());
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    Tracer* tracer;
+    const char* name;
+    int64_t start;
+    const char* previous_source;
+    bool flow_source;
+};
+
+} // namespace flow
@@ -0,0 +1,79 @@
+#include "flow/callback_group.h"
+#include <memory>
+
+
+namespace flow {
+
+CallbackGroup::CallbackGroup(
+    Engine& engine,
+    CallbackGroupType type,
+    const std::string& name,
+    Priority priority,
+    size_t queue_size,
+    size_t max_batch
+):
+    engine(engine),
+    type_(type),
+    id(engine.register_callback(name)),
+    priority(priority),
+    max_batch(max_batch == 0 ? 1 : max_batch),
+    queue(queue_size),
+    overflow_count(0),
+    pending(0)
+{}
+
+void CallbackGroup::push_callback(Task callback) {
+    if (type_ == CallbackGroupType::Reentrant) {
+        engine.push_callback(id, std::move(callback), priority);
+        return;
+    }
+
+    if (overflow_count > 0 || !queue.try_push(std::move(callback))) {
+        std::scoped_lock<std::mutex> lock(overflow_mutex);
+        overflow_queue.push(std::move(callback));
+        overflow_count++;
+    }
+    if (pending.fetch_add(1, std::memory_order_acq_rel) == 0) {
+        engine.push_callback(id, [this]() { process(); }, priority);
+    }
+}
+
+Engine::TimerId CallbackGroup::create_timer_callback(double period, const timer_callback_t& callback) {
+    auto shared_callback = std::make_shared<timer_callback_t>(callback);
+    return engine.create_timer_callback(period, [this, shared_callback](TimePoint time) {
+        push_callback([shared_callback, time]() {
+            (*shared_callback)(time);
+        });
+    }, "timer", priority);
+}
+
+bool CallbackGroup::pop(Task& callback) {
+    if (queue.try_pop(callback)) {
+        return true;
+    }
+    if (overflow_count > 0) {
+        std::scoped_lock<std::mutex> lock(overflow_mutex);
+        if (overflow_queue.try_pop(callback)) {
+            overflow_count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CallbackGroup::process() {
+    for (size_t i = 0; i < max_batch; i++) {
+        // A push counts as pending once it completes, but an earlier push
+        // may have claimed the slot in front of it and not yet filled it.
+        // The group stays scheduled, so try again once that finishes.
+        Task callback;
+        if (!pop(callback)) break;
+        callback();
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            return;
+        }
+    }
+    engine.push_callback(id, [this]() { process(); }, priority);
+}
+
+} // namespace flow
@@ -1,194 +1,888 @@
 #include "flow/engine.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
 
 
 namespace flow {
 
-Engine::Engine():
-    start_init(false),
+// Identifies the callback thread (if any) running on the current thread,
+// so that work-stealing pushes can go to the local run queue.
+static thread_local const Engine* current_engine = nullptr;
+static thread_local size_t current_worker = 0;
+
+// Deterministic runs only have the shared queue
+static EngineConfig validate(EngineConfig config) {
+    if (config.deterministic) {
+        config.simulated_time = true;
+        config.scheduler = Scheduler::Fifo;
+    }
+    return config;
+}
+
+Engine::Engine(const EngineConfig& config):
+    config(validate(config)),
+    time_source(nullptr),
+    phase(Phase::Idle),
     init_count(0),
     init_valid(true),
-    running(false),
-    time_source(nullptr)
-{}
+    shutdown_count(0),
+    initial_timestamp(TimePoint::now_timestamp()),
+    run_start(monotonic_ns()),
+    sim_time(0),
+    busy_count(0),
+    next_timer_id(0),
+    timer_batch_id(nullptr),
+    sleep_id(nullptr),
+    lane_skips{},
+    lanes_size(0),
+    high_count(0),
+    pending_count(0),
+    injected_count(0),
+    sleeping_count(0),
+    poll_thread_count(0),
+    unnamed_id(nullptr)
+{
+    if (config.tracing) {
+        tracer = std::make_unique<Tracer>(config.trace_buffer_size);
+    }
+    unnamed_id = register_callback("unnamed");
+    timer_batch_id = register_callback("timers");
+    sleep_id = register_callback("sleep");
+}
+
+void Engine::push_callback(Task callback, Priority priority) {
+    push_callback(nullptr, std::move(callback), priority);
+}
+
+Engine::QueuedCallback Engine::make_queued(CallbackId id, Task callback) {
+    QueuedCallback queued;
+    queued.task = std::move(callback);
+    queued.id = id ? id : unnamed_id;
+    if (config.simulated_time) {
+        busy_count++;
+    }
+    if (config.instrumentation) {
+        queued.push_time = monotonic_ns();
+    }
+    if (Tracer* tracer = Tracer::current()) {
+        queued.flow = tracer->record_flow_start();
+    }
+    return queued;
+}
+
+void Engine::push_callback(CallbackId id, Task callback, Priority priority) {
+    QueuedCallback queued = make_queued(id, std::move(callback));
+
+    if (config.scheduler == Scheduler::Fifo) {
+        size_t depth;
+        {
+            std::scoped_lock<std::mutex> lock(queue_mutex);
+            callback_lanes[size_t(priority)].push(std::move(queued));
+            depth = ++lanes_size;
+            if (priority == Priority::High) high_count++;
+        }
+        cv.notify_one();
+        if (config.instrumentation) queue_depth.record(depth);
+        return;
+    }
+
+    // Counted before publishing, since a stealer may pop and decrement it
+    // as soon as it's published. A failed try_push leaves the callback
+    // untouched, so it can still be moved into the injection queue.
+    size_t depth = ++pending_count;
+    bool local = current_engine == this && priority == Priority::Normal;
+    bool injected = false;
+    if (!local || !workers[current_worker]->queue.try_push(std::move(queued))) {
+        std::scoped_lock<std::mutex> lock(queue_mutex);
+        callback_lanes[size_t(priority)].push(std::move(queued));
+        lanes_size++;
+        if (priority == Priority::High) high_count++;
+        injected_count++;
+        injected = true;
+    }
+    if (config.instrumentation) queue_depth.record(depth);
+
+    // Sleepers register under queue_mutex before re-checking pending_count,
+    // so taking the mutex after incrementing it (as an injected push
+    // already has) means the notify cannot be lost.
+    if (sleeping_count > 0) {
+        if (!injected) {
+            std::scoped_lock<std::mutex> lock(queue_mutex);
+        }
+        cv.notify_one();
+    }
+}
+
+// Pushes every callback to the shared lanes with one lock, so is only
+// for threads that aren't workers (or wouldn't use their local queue).
+void Engine::push_callbacks(CallbackId id, std::vector<std::pair<Task, Priority>>& callbacks) {
+    size_t count = callbacks.size();
+    if (count == 0) return;
+
+    size_t depth = 0;
+    if (config.scheduler == Scheduler::WorkStealing) {
+        depth = pending_count += count;
+    }
+    {
+        std::scoped_lock<std::mutex> lock(queue_mutex);
+        for (auto& [callback, priority]: callbacks) {
+            callback_lanes[size_t(priority)].push(make_queued(id, std::move(callback)));
+            if (priority == Priority::High) high_count++;
+        }
+        lanes_size += count;
+        if (config.scheduler == Scheduler::WorkStealing) {
+            injected_count += count;
+        } else {
+            depth = lanes_size;
+        }
+    }
+    callbacks.clear();
 
-void Engine::push_callback(const callback_t& callback) {
+    if (config.instrumentation) queue_depth.record(depth);
+    if (count == 1) {
+        cv.notify_one();
+    } else {
+        cv.notify_all();
+    }
+}
+
+Engine::CallbackId Engine::register_callback(const std::string& name) {
+    if (!config.instrumentation && !config.tracing) return nullptr;
+    std::scoped_lock<std::mutex> lock(counters_mutex);
+    callback_counters.push_back(std::make_unique<CallbackCounters>(name));
+    return callback_counters.back().get();
+}
+
+EngineStats Engine::get_stats() const {
+    EngineStats stats;
+    stats.time = get_time();
     {
+        std::scoped_lock<std::mutex> lock(counters_mutex);
+        for (const auto& counters: callback_counters) {
+            stats.callbacks.push_back(counters->load());
+        }
+    }
+    if (config.scheduler == Scheduler::Fifo) {
         std::scoped_lock<std::mutex> lock(queue_mutex);
-        callback_queue.push(callback);
+        stats.queue_depth = lanes_size;
+    } else {
+        stats.queue_depth = pending_count;
     }
-    cv.notify_one();
+    stats.queue_depth_samples = queue_depth.load();
+    return stats;
+}
+
+void Engine::write_trace(std::ostream& os) const {
+    if (!tracer) return;
+    tracer->write_json(os);
+}
+
+bool Engine::write_trace(const std::string& path) const {
+    if (!tracer) return false;
+    std::ofstream file(path);
+    if (!file.is_open()) return false;
+    tracer->write_json(file);
+    return file.good();
 }
 
-void Engine::create_poll_callback(const bool_callback_t& poll) {
-    threads.emplace_back([poll, this](){
-        while (!running && init_valid) {}
-        if (!init_valid) return;
-        while (running && poll()) {}
+void Engine::create_poll_callback(const bool_callback_t& poll, const std::string& name) {
+    CallbackId id = register_callback(name);
+    threads.emplace_back([poll, id, this](){
+        if (wait_for_phase(Phase::Running) != Phase::Running) return;
+        execute_poll(poll, id);
     });
+    configure(threads.back(), config.poll_threads, name, poll_thread_count++);
 }
 
-void Engine::create_init_poll_callback(const bool_callback_t& init, const bool_callback_t& poll) {
-    threads.emplace_back([init, poll, this](){
-        init_count++;
-        while (!start_init) {}
-        if (!init()) {
-            init_valid = false;
-            init_count--;
-            return;
-        }
-        init_count--;
-        while (!running && init_valid) {}
-        if (!init_valid) return;
-        while (running && poll()) {}
+void Engine::create_init_poll_callback(const bool_callback_t& init, const bool_callback_t& poll, const std::string& name) {
+    init_count++;
+    CallbackId id = register_callback(name);
+    threads.emplace_back([init, poll, id, this](){
+        if (!execute_init(init)) return;
+        if (wait_for_phase(Phase::Running) != Phase::Running) return;
+        execute_poll(poll, id);
     });
+    configure(threads.back(), config.poll_threads, name, poll_thread_count++);
 }
 
-void Engine::create_poll_shutdown_callback(const bool_callback_t& poll, const callback_t& shutdown) {
-    threads.emplace_back([poll, shutdown, this](){
-        while (!running && init_valid) {}
-        if (init_valid) {
-            while (running && poll()) {}
+void Engine::create_poll_shutdown_callback(const bool_callback_t& poll, const callback_t& shutdown, const std::string& name) {
+    CallbackId id = register_callback(name);
+    threads.emplace_back([poll, shutdown, id, this](){
+        if (wait_for_phase(Phase::Running) == Phase::Running) {
+            execute_poll(poll, id);
         }
         shutdown();
     });
+    configure(threads.back(), config.poll_threads, name, poll_thread_count++);
 }
 
 void Engine::create_init_poll_shutdown_callback(
     const bool_callback_t& init,
     const bool_callback_t& poll,
-    const callback_t& shutdown)
+    const callback_t& shutdown,
+    const std::string& name)
 {
-    threads.emplace_back([init, poll, shutdown, this](){
-        init_count++;
-        while (!start_init) {}
-        if (!init()) {
-            init_valid = false;
-            init_count--;
-            return;
-        }
-        init_count--;
-        while (!running && init_valid) {}
-        if (init_valid) {
-            while (running && poll()) {}
+    init_count++;
+    CallbackId id = register_callback(name);
+    threads.emplace_back([init, poll, shutdown, id, this](){
+        if (!execute_init(init)) return;
+        if (wait_for_phase(Phase::Running) == Phase::Running) {
+            execute_poll(poll, id);
         }
         shutdown();
     });
+    configure(threads.back(), config.poll_threads, name, poll_thread_count++);
 }
 
 void Engine::create_init_callback(const bool_callback_t& init)
 {
+    init_count++;
     threads.emplace_back([init, this](){
-        init_count++;
-        while (!start_init) {}
-        if (!init()) {
-            init_valid = false;
-            init_count--;
-            return;
-        }
-        init_count--;
+        execute_init(init);
     });
+    configure(threads.back(), ThreadConfig(), "flow-init", 0);
 }
 
 void Engine::create_shutdown_callback(const callback_t& shutdown)
 {
-    // TODO: Don't need thread for this
-    threads.emplace_back([shutdown, this](){
-        while (!running && init_valid) {}
-        if (init_valid) {
-            while (running) {}
-        }
-        shutdown();
-    });
+    shutdown_callbacks.push_back(shutdown);
 }
 
-void Engine::create_timer_callback(double period, const timer_callback_t& callback) {
-    TimerCallback timer_callback;
-    timer_callback.period = period;
-    timer_callback.next_time = 0;
-    timer_callback.callback = callback;
-    timer_callbacks.push_back(timer_callback);
+Engine::TimerId Engine::create_timer_callback(
+    double period,
+    const timer_callback_t& callback,
+    const std::string& name,
+    Priority priority,
+    double offset)
+{
+    auto timer_callback = std::make_shared<TimerCallback>();
+    timer_callback->period = std::max<int64_t>(1, std::llround(1e9 * period));
+    timer_callback->next_time = (phase == Phase::Running ? elapsed_ns(get_time()) : 0) + std::llround(1e9 * offset);
+    timer_callback->callback = callback;
+    timer_callback->id = register_callback(name);
+    timer_callback->priority = priority;
+    return add_timer(timer_callback);
 }
 
-TimePoint Engine::get_time() const {
-    TimePoint temp;
+Engine::TimerId Engine::create_deadline_callback(
+    double time,
+    const timer_callback_t& callback,
+    const std::string& name,
+    Priority priority)
+{
+    return create_deadline_callback(time, callback, register_callback(name), priority);
+}
+
+Engine::TimerId Engine::create_deadline_callback(
+    double time,
+    const timer_callback_t& callback,
+    CallbackId id,
+    Priority priority)
+{
+    auto timer_callback = std::make_shared<TimerCallback>();
+    timer_callback->period = 0;
+    timer_callback->next_time = std::llround(1e9 * time);
+    timer_callback->callback = callback;
+    timer_callback->id = id;
+    timer_callback->priority = priority;
+    return add_timer(timer_callback);
+}
+
+Engine::TimerId Engine::add_timer(const std::shared_ptr<TimerCallback>& timer) {
+    TimerId id;
     {
-        std::shared_lock<std::shared_mutex> lock(time_mutex);
-        temp = time;
+        std::scoped_lock<std::mutex> lock(timer_mutex);
+        id = next_timer_id++;
+        timer_callbacks.emplace(id, timer);
+        timer_deadlines.push(TimerDeadline{timer->next_time, id});
     }
-    return temp;
+    timer_cv.notify_one();
+    return id;
+}
+
+Engine::SleepAwaiter Engine::sleep_until(double time, Priority priority) {
+    return SleepAwaiter(*this, time, priority);
+}
+
+Engine::SleepAwaiter Engine::sleep_for(double duration, Priority priority) {
+    return SleepAwaiter(*this, get_time().time + duration, priority);
+}
+
+// Uses a deadline timer under the shared "sleep" name, since registering
+// a name per sleep would add a new set of counters every time.
+void Engine::SleepAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    auto timer = std::make_shared<TimerCallback>();
+    timer->period = 0;
+    timer->next_time = std::llround(1e9 * deadline);
+    timer->callback = [this, handle](TimePoint now) {
+        time = now;
+        handle.resume();
+    };
+    timer->id = engine.sleep_id;
+    timer->priority = priority;
+    engine.add_timer(timer);
+}
+
+void Engine::cancel_timer_callback(TimerId id) {
+    std::scoped_lock<std::mutex> lock(timer_mutex);
+    timer_callbacks.erase(id);
+}
+
+TimePoint Engine::get_time() const {
+    if (time_source && !config.simulated_time && phase != Phase::Idle) {
+        return source_time.load();
+    }
+    return read_time();
+}
+
+TimePoint Engine::get_tick_time() const {
+    return tick_time.load();
+}
+
+TimePoint Engine::read_time() const {
+    if (config.simulated_time) {
+        TimePoint result;
+        result.timestamp = sim_time;
+        result.time = 1e-9 * static_cast<double>(result.timestamp);
+        double real = 1e-9 * static_cast<double>(monotonic_ns() - run_start);
+        result.rate = real > 0 ? result.time / real : 0;
+        return result;
+    }
+    if (time_source) {
+        return time_source();
+    }
+    // Timers created before the clock starts are relative to its start,
+    // so their deadlines don't pass while the init callbacks run
+    Phase current = phase;
+    int64_t elapsed = current == Phase::Idle || current == Phase::Init ? 0 : monotonic_ns() - run_start;
+    TimePoint result;
+    result.time = 1e-9 * static_cast<double>(elapsed);
+    result.timestamp = initial_timestamp + elapsed;
+    result.rate = 1;
+    return result;
+}
+
+// Engine time in nanoseconds, used for timer deadlines. A time source
+// may not provide a timestamp relative to the start, so its time is used.
+int64_t Engine::elapsed_ns(const TimePoint& time) const {
+    if (config.simulated_time) {
+        return time.timestamp;
+    }
+    if (time_source) {
+        return std::llround(1e9 * time.time);
+    }
+    return time.timestamp - initial_timestamp;
 }
 
 void Engine::set_time_source(const time_source_t& time_source) {
     this->time_source = time_source;
 }
 
+// Under timer_mutex, like the timer thread's updates, so that each store
+// reads the source afresh and the published time never goes backwards
+void Engine::update_time_source() {
+    if (!time_source || config.simulated_time) return;
+    std::scoped_lock<std::mutex> lock(timer_mutex);
+    source_time.store(time_source());
+}
+
+// Restarts the clock as the engine starts running, before the phase
+// changes, so threads that see Running also see the new start
+void Engine::start_clock() {
+    initial_timestamp = TimePoint::now_timestamp();
+    run_start = monotonic_ns();
+}
+
 void Engine::run(size_t num_callback_threads) {
     if (num_callback_threads == 0) num_callback_threads = 1;
 
+    initial_timestamp = TimePoint::now_timestamp();
+    run_start = monotonic_ns();
+    if (time_source) {
+        source_time.store(time_source());
+    }
+
+    if (config.deterministic) {
+        run_deterministic();
+        return;
+    }
+
     // Timing thread
     threads.emplace_back([this](){
-        while (!running && init_valid) {}
-        int64_t initial_timestamp = TimePoint::now_timestamp();
-
-        while (running && init_valid) {
-            TimePoint new_time;
-            if (time_source) {
-                new_time = time_source();
-            } else {
-                new_time = TimePoint::now(initial_timestamp);
-            }
+        if (wait_for_phase(Phase::Running) != Phase::Running) return;
+        if (tracer) tracer->attach("timer");
+        if (config.simulated_time) {
+            execute_simulated_timers();
+        } else {
+            execute_timers();
+        }
+        Tracer::detach();
+    });
+    configure(threads.back(), config.timer_thread, "flow-timer", 0);
 
-            {
-                std::scoped_lock<std::shared_mutex> lock(time_mutex);
-                time = new_time;
-            }
+    if (config.scheduler == Scheduler::WorkStealing) {
+        workers.clear();
+        for (size_t i = 0; i < num_callback_threads; i++) {
+            workers.push_back(std::make_unique<Worker>(config.worker_queue_size));
+        }
+    }
 
-            for (auto& callback: timer_callbacks) {
-                if (callback.next_time < new_time.time) {
-                    // Copy the current time instead of using reference
-                    // when constructing lambda for callback.
-                    push_callback(std::bind([new_time, &callback]() {
-                        callback.callback(new_time);
-                    }));
-                    callback.next_time += callback.period;
+    // Callback threads keep running through the shutdown phase, so that
+    // they can execute the shutdown callbacks.
+    for (size_t i = 0; i < num_callback_threads; i++) {
+        threads.emplace_back([this, i](){
+            wait_for_phase(Phase::Running);
+            if (tracer) tracer->attach("callback " + std::to_string(i));
+            if (config.scheduler == Scheduler::Fifo) {
+                while (phase != Phase::Stopped) {
+                    execute_callback();
                 }
+                Tracer::detach();
+                return;
             }
-        }
-    });
+            current_engine = this;
+            current_worker = i;
+            while (phase != Phase::Stopped) {
+                execute_callback_stealing(i);
+            }
+            current_engine = nullptr;
+            Tracer::detach();
+        });
+        configure(threads.back(), config.callback_threads, "flow-worker-" + std::to_string(i), i);
+    }
 
-    for (size_t i = 0; i < num_callback_threads; i++) {
-        threads.emplace_back([this](){
-            while (!running && init_valid) {}
-            while (running) {
-                execute_callback();
+    set_phase(Phase::Idle, Phase::Init);
+    int count;
+    while ((count = init_count) > 0) {
+        init_count.wait(count);
+    }
+    start_clock();
+    set_phase(Phase::Init, init_valid ? Phase::Running : Phase::Shutdown);
+
+    wait_for_phase(Phase::Shutdown);
+    shutdown_count = shutdown_callbacks.size();
+    for (const auto& shutdown: shutdown_callbacks) {
+        push_callback([this, shutdown](){
+            shutdown();
+            if (--shutdown_count == 0) {
+                shutdown_count.notify_all();
             }
         });
     }
+    size_t remaining;
+    while ((remaining = shutdown_count) > 0) {
+        shutdown_count.wait(remaining);
+    }
+    set_phase(Phase::Shutdown, Phase::Stopped);
+
+    for (auto& thread: threads) {
+        thread.join();
+    }
+
+    if (tracer && !config.trace_path.empty()) {
+        write_trace(config.trace_path);
+    }
+}
+
+void Engine::run_deterministic() {
+    if (tracer) tracer->attach("flow-main");
+
+    set_phase(Phase::Idle, Phase::Init);
+    int count;
+    while ((count = init_count) > 0) {
+        init_count.wait(count);
+    }
+    start_clock();
+    set_phase(Phase::Init, init_valid ? Phase::Running : Phase::Shutdown);
 
-    start_init = true;
-    while (init_count > 0) {}
-    running = true;
+    std::unique_lock<std::mutex> lock(timer_mutex, std::defer_lock);
+    while (phase == Phase::Running) {
+        if (execute_next()) continue;
+
+        lock.lock();
+        fire_timers(read_time());
+        if (busy_count == 0) {
+            int64_t next_time;
+            if (next_deadline(next_time)) {
+                advance_time(next_time);
+            } else {
+                // Only a poll callback can add work now
+                timer_cv.wait_for(lock, std::chrono::duration<double>(config.time_source_poll_period));
+            }
+        }
+        lock.unlock();
+    }
+
+    // Callbacks still queued are run along with the shutdown callbacks,
+    // as there is no other thread to leave them to.
+    for (const auto& shutdown: shutdown_callbacks) {
+        push_callback(shutdown);
+    }
+    while (execute_next()) {}
+    set_phase(Phase::Shutdown, Phase::Stopped);
+    Tracer::detach();
 
     for (auto& thread: threads) {
         thread.join();
     }
+
+    if (tracer && !config.trace_path.empty()) {
+        write_trace(config.trace_path);
+    }
+}
+
+bool Engine::execute_next() {
+    QueuedCallback callback;
+    {
+        std::scoped_lock<std::mutex> lock(queue_mutex);
+        if (!pop_lane(callback)) return false;
+    }
+    execute(callback);
+    return true;
 }
 
 void Engine::stop() {
-    running = false;
+    Phase current = phase;
+    while (current < Phase::Shutdown) {
+        if (set_phase(current, Phase::Shutdown)) return;
+        current = phase;
+    }
+}
+
+bool Engine::set_phase(Phase from, Phase to) {
+    if (!phase.compare_exchange_strong(from, to)) {
+        return false;
+    }
+    phase.notify_all();
+
+    // Threads waiting on the condition variables check the phase in their
+    // predicate, so take each mutex before notifying to avoid a lost wakeup.
+    {
+        std::scoped_lock<std::mutex> lock(queue_mutex);
+    }
     cv.notify_all();
+    {
+        std::scoped_lock<std::mutex> lock(timer_mutex);
+    }
+    timer_cv.notify_all();
+    return true;
+}
+
+Engine::Phase Engine::wait_for_phase(Phase target) const {
+    Phase current;
+    while ((current = phase) < target) {
+        phase.wait(current);
+    }
+    return current;
+}
+
+void Engine::configure(std::jthread& thread, const ThreadConfig& thread_config, const std::string& name, size_t index) {
+    if (!configure_thread(thread.native_handle(), thread_config, name, index) && thread_config.required) {
+        init_valid = false;
+    }
+}
+
+bool Engine::execute_init(const bool_callback_t& init) {
+    bool valid = wait_for_phase(Phase::Init) == Phase::Init && init();
+    if (!valid) {
+        init_valid = false;
+    }
+    if (--init_count == 0) {
+        init_count.notify_all();
+    }
+    return valid;
+}
+
+void Engine::execute_poll(const bool_callback_t& poll, CallbackId id) {
+    if (!id) {
+        while (phase == Phase::Running && poll()) {}
+        return;
+    }
+    if (tracer) tracer->attach(id->name);
+    while (phase == Phase::Running) {
+        int64_t start = monotonic_ns();
+        bool valid = poll();
+        int64_t end = monotonic_ns();
+        if (config.instrumentation) id->record_execution(end - start);
+        if (tracer) tracer->record_slice(id->name.c_str(), start, end);
+        if (!valid) break;
+    }
+    Tracer::detach();
+}
+
+void Engine::execute_timers() {
+    std::unique_lock<std::mutex> lock(timer_mutex);
+    while (phase == Phase::Running) {
+        TimePoint now = read_time();
+        if (time_source) source_time.store(now);
+        fire_timers(now);
+
+        int64_t next_time;
+        if (!next_deadline(next_time)) {
+            // Keep the time source snapshot fresh even without timers
+            if (time_source) {
+                timer_cv.wait_for(lock, std::chrono::duration<double>(config.time_source_poll_period));
+            } else {
+                timer_cv.wait(lock);
+            }
+            continue;
+        }
+
+        double wait = 1e-9 * static_cast<double>(next_time - elapsed_ns(now));
+        if (now.rate > 0) wait /= now.rate;
+        if (time_source) wait = std::min(wait, config.time_source_poll_period);
+        timer_cv.wait_for(lock, std::chrono::duration<double>(wait));
+    }
+}
+
+void Engine::execute_simulated_timers() {
+    std::unique_lock<std::mutex> lock(timer_mutex);
+    while (phase == Phase::Running) {
+        fire_timers(read_time());
+
+        // Callbacks take timer_mutex to notify when the last one finishes
+        timer_cv.wait(lock, [&]{ return busy_count == 0 || phase != Phase::Running; });
+        if (phase != Phase::Running) break;
+
+        int64_t next_time;
+        if (next_deadline(next_time)) {
+            advance_time(next_time);
+        } else {
+            // Only a poll callback can add work now
+            timer_cv.wait_for(lock, std::chrono::duration<double>(config.time_source_poll_period));
+        }
+    }
+}
+
+void Engine::advance_time(int64_t next_time) {
+    if (next_time > sim_time) {
+        sim_time = next_time;
+    }
+}
+
+bool Engine::next_deadline(int64_t& next_time) {
+    while (!timer_deadlines.empty()) {
+        const TimerDeadline& deadline = timer_deadlines.top();
+        if (timer_callbacks.count(deadline.id) > 0) {
+            next_time = deadline.next_time;
+            return true;
+        }
+        timer_deadlines.pop();
+    }
+    return false;
+}
+
+// Pushes every timer which is due, in one batch
+void Engine::fire_timers(const TimePoint& now) {
+    int64_t now_ns = elapsed_ns(now);
+    int64_t window = std::llround(1e9 * config.timer_coalesce_window);
+    TimerBatch* batch = nullptr;
+    while (!timer_deadlines.empty()) {
+        TimerDeadline deadline = timer_deadlines.top();
+        auto iter = timer_callbacks.find(deadline.id);
+        if (iter == timer_callbacks.end()) {
+            timer_deadlines.pop();
+            continue;
+        }
+        if (deadline.next_time > now_ns + window) break;
+        timer_deadlines.pop();
+
+        std::shared_ptr<TimerCallback> timer = iter->second;
+        if (config.instrumentation) {
+            timer->id->record_lateness(now_ns - deadline.next_time);
+        }
+        if (!batch) {
+            batch = acquire_timer_batch();
+            tick_time.store(now);
+        }
+        batch->timers.push_back(timer);
+        if (timer->period == 0) {
+            timer_callbacks.erase(iter);
+            continue;
+        }
+        // Requeued after the pass, so a timer that has fallen behind fires
+        // at most once per pass, and catches up over the following passes.
+        timer->next_time += timer->period;
+        timer_requeue.push_back(TimerDeadline{timer->next_time, deadline.id});
+    }
+    for (const TimerDeadline& deadline: timer_requeue) {
+        timer_deadlines.push(deadline);
+    }
+    timer_requeue.clear();
+
+    if (batch) {
+        batch->now = now;
+        dispatch_timer_batch(batch);
+    }
+}
+
+Engine::TimerBatch* Engine::acquire_timer_batch() {
+    std::scoped_lock<std::mutex> lock(timer_batch_mutex);
+    if (free_timer_batches.empty()) {
+        timer_batches.push_back(std::make_unique<TimerBatch>());
+        return timer_batches.back().get();
+    }
+    TimerBatch* batch = free_timer_batches.back();
+    free_timer_batches.pop_back();
+    return batch;
+}
+
+// Splits the batch into chunks of up to timer_chunk_size timers with the
+// same priority, and pushes them all at once.
+void Engine::dispatch_timer_batch(TimerBatch* batch) {
+    // Sort by priority, keeping the order within each priority, into
+    // a reused buffer (std::stable_sort would allocate every time).
+    auto& timers = batch->timers;
+    auto by_priority = [](const auto& lhs, const auto& rhs) { return lhs->priority < rhs->priority; };
+    if (!std::is_sorted(timers.begin(), timers.end(), by_priority)) {
+        timer_sort_buffer.clear();
+        for (size_t lane = 0; lane < num_lanes; lane++) {
+            // Timers taken by an earlier lane are left empty
+            for (auto& timer: timers) {
+                if (timer && size_t(timer->priority) == lane) timer_sort_buffer.push_back(std::move(timer));
+            }
+        }
+        timers.swap(timer_sort_buffer);
+    }
+    size_t chunk_size = std::max<size_t>(1, config.timer_chunk_size);
+
+    size_t begin = 0;
+    while (begin < timers.size()) {
+        Priority priority = timers[begin]->priority;
+        size_t end = begin + 1;
+        while (end < timers.size() && end - begin < chunk_size && timers[end]->priority == priority) {
+            end++;
+        }
+        timer_chunks.emplace_back([this, batch, begin, end]() {
+            execute_timer_chunk(batch, begin, end);
+        }, priority);
+        begin = end;
+    }
+
+    batch->remaining = timer_chunks.size();
+    batch->push_time = config.instrumentation ? monotonic_ns() : 0;
+    TraceScope scope("timers");
+    push_callbacks(timer_batch_id, timer_chunks);
+}
+
+void Engine::execute_timer_chunk(TimerBatch* batch, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+        TimerCallback& timer = *batch->timers[i];
+        if (!timer.id) {
+            timer.callback(batch->now);
+            continue;
+        }
+        int64_t start = monotonic_ns();
+        if (config.instrumentation) timer.id->record_wait(start - batch->push_time);
+        timer.callback(batch->now);
+        int64_t finish = monotonic_ns();
+        if (config.instrumentation) timer.id->record_execution(finish - start);
+        if (tracer) tracer->record_slice(timer.id->name.c_str(), start, finish);
+    }
+
+    if (--batch->remaining == 0) {
+        batch->timers.clear();
+        std::scoped_lock<std::mutex> lock(timer_batch_mutex);
+        free_timer_batches.push_back(batch);
+    }
+}
+
+void Engine::execute(QueuedCallback& callback) {
+    if (!callback.id) {
+        callback.task();
+    } else {
+        int64_t start = monotonic_ns();
+        if (config.instrumentation) callback.id->record_wait(start - callback.push_time);
+        if (tracer && callback.flow) tracer->record_flow_end(callback.flow, start);
+        callback.task();
+        int64_t end = monotonic_ns();
+        if (config.instrumentation) callback.id->record_execution(end - start);
+        if (tracer) tracer->record_slice(callback.id->name.c_str(), start, end);
+    }
+
+    // With simulated time, the timing thread waits for the engine to be
+    // idle before advancing
+    if (config.simulated_time && --busy_count == 0) {
+        { std::scoped_lock<std::mutex> lock(timer_mutex); }
+        timer_cv.notify_all();
+    }
+}
+
+bool Engine::pop_lane(QueuedCallback& callback) {
+    for (size_t lane = num_lanes - 1; lane > 0; lane--) {
+        if (lane_skips[lane] >= config.starvation_limit && callback_lanes[lane].try_pop(callback)) {
+            lane_skips[lane] = 0;
+            lanes_size--;
+            return true;
+        }
+    }
+    for (size_t lane = 0; lane < num_lanes; lane++) {
+        if (!callback_lanes[lane].try_pop(callback)) continue;
+        lane_skips[lane] = 0;
+        for (size_t lower = lane + 1; lower < num_lanes; lower++) {
+            if (!callback_lanes[lower].empty()) lane_skips[lower]++;
+        }
+        lanes_size--;
+        if (lane == size_t(Priority::High)) high_count--;
+        return true;
+    }
+    return false;
 }
 
 void Engine::execute_callback() {
     std::unique_lock<std::mutex> lock(queue_mutex);
-    cv.wait(lock, [&]{ return callback_queue.size() > 0 || !running; });
-    if (!running) return;
+    cv.wait(lock, [&]{ return lanes_size > 0 || phase == Phase::Stopped; });
+    if (phase == Phase::Stopped) return;
 
-    assert(!callback_queue.empty());
-    callback_t callback = callback_queue.front();
-    callback_queue.pop();
+    QueuedCallback callback;
+    [[maybe_unused]] bool popped = pop_lane(callback);
+    assert(popped);
     lock.unlock();
-    callback();
+    execute(callback);
+}
+
+void Engine::execute_callback_stealing(size_t worker) {
+    QueuedCallback callback;
+    if (pop_callback(worker, callback)) {
+        pending_count--;
+        execute(callback);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    sleeping_count++;
+    cv.wait(lock, [&]{ return pending_count > 0 || phase == Phase::Stopped; });
+    sleeping_count--;
+}
+
+bool Engine::pop_callback(size_t worker, QueuedCallback& callback) {
+    // Every so often check the injection queue first, so that callbacks
+    // pushed from other threads aren't starved by a busy local queue.
+    // High priority callbacks are only ever in the injection queue, so
+    // are always checked for first.
+    Worker& local = *workers[worker];
+    if (local.ticks++ % 61 != 0 && high_count == 0 && local.queue.try_pop(callback)) {
+        return true;
+    }
+    if (injected_count > 0) {
+        std::scoped_lock<std::mutex> lock(queue_mutex);
+        if (pop_lane(callback)) {
+            injected_count--;
+            return true;
+        }
+    }
+    if (local.queue.try_pop(callback)) {
+        return true;
+    }
+    for (size_t i = 1; i < workers.size(); i++) {
+        size_t victim = (worker + i) % workers.size();
+        if (workers[victim]->queue.try_pop(callback)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 } // namespace flow
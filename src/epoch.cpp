@@ -0,0 +1,127 @@
+#include "flow/epoch.h"
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+namespace flow {
+
+// Starts from one, since zero marks a record with no read section
+std::atomic<uint64_t> global_epoch(1);
+
+#ifdef __linux__
+
+static bool register_membarrier()
+{
+    int commands = syscall(SYS_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+    if (commands < 0 || !(commands & MEMBARRIER_CMD_PRIVATE_EXPEDITED)) return false;
+    return syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+}
+
+// Decided during static initialization, before other threads exist, so
+// readers and writers always agree on it. Until then it is false, so read
+// sections take a fence.
+bool epoch_membarrier = register_membarrier();
+
+static void reader_barrier()
+{
+    if (epoch_membarrier) {
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+    }
+}
+
+#else
+
+bool epoch_membarrier = false;
+
+static void reader_barrier() {}
+
+#endif
+
+// Function statics, so they exist before any thread's record is created,
+// and outlive the records of the main thread.
+static std::mutex& records_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+static std::vector<EpochRecord*>& records()
+{
+    static std::vector<EpochRecord*> records;
+    return records;
+}
+
+// Unregisters the thread's record when the thread exits
+struct EpochRegistration {
+    ~EpochRegistration()
+    {
+        std::scoped_lock<std::mutex> lock(records_mutex());
+        auto& all = records();
+        all.erase(std::remove(all.begin(), all.end(), &epoch_record), all.end());
+        epoch_record.registered = false;
+    }
+};
+
+void epoch_register_thread()
+{
+    static thread_local EpochRegistration registration;
+    std::scoped_lock<std::mutex> lock(records_mutex());
+    records().push_back(&epoch_record);
+    epoch_record.registered = true;
+}
+
+uint64_t epoch_retire()
+{
+    return global_epoch.fetch_add(1);
+}
+
+uint64_t epoch_oldest_reader()
+{
+    // Either a reader's record is visible by now, or the reader will see
+    // the data published before its retirement
+    reader_barrier();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint64_t oldest = global_epoch.load();
+    std::scoped_lock<std::mutex> lock(records_mutex());
+    for (const EpochRecord* record: records()) {
+        uint64_t epoch = record->epoch.load(std::memory_order_acquire);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+void epoch_synchronize(uint64_t epoch)
+{
+    reader_barrier();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    while (true) {
+        bool finished = true;
+        {
+            std::scoped_lock<std::mutex> lock(records_mutex());
+            for (const EpochRecord* record: records()) {
+                if (record == &epoch_record) continue;
+                uint64_t started = record->epoch.load(std::memory_order_acquire);
+                if (started != 0 && started <= epoch) {
+                    finished = false;
+                    break;
+                }
+            }
+        }
+        if (finished) return;
+        // Read sections are short, so this rarely waits long
+        std::this_thread::yield();
+    }
+}
+
+} // namespace flow
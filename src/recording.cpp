@@ -0,0 +1,420 @@
+#include "flow/recording.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace flow {
+
+// The log starts with a file header, followed by records, each a header
+// then the message, padded to a multiple of 8 bytes. Channel ids start
+// from 1, so zeroed space past the end of the log reads as channel 0.
+// Channel names are written as records on meta_channel.
+struct LogHeader {
+    uint64_t magic;
+    uint64_t version;
+};
+
+struct RecordHeader {
+    int64_t time;
+    uint32_t channel;
+    uint32_t size;
+};
+
+static constexpr uint64_t log_magic = 0x31474f4c574f4c46; // "FLOWLOG1"
+static constexpr uint64_t index_magic = 0x31584449574f4c46; // "FLOWIDX1"
+static constexpr uint64_t log_version = 1;
+static constexpr uint32_t meta_channel = UINT32_MAX;
+// Bytes of log between index entries
+static constexpr size_t index_interval = 1 << 20;
+// Records played per call to poll, so it notices the engine stopping
+static constexpr size_t play_batch = 4096;
+// Longest a player sleeps while waiting for the next message
+static constexpr double max_play_wait = 10e-3;
+
+static size_t padded(size_t size)
+{
+    return (size + 7) & ~size_t(7);
+}
+
+static std::string index_path(const std::string& path)
+{
+    return path + ".index";
+}
+
+#ifdef __linux__
+
+Recorder::Recorder(Engine& engine, const std::string& path, size_t chunk_size):
+    engine(engine),
+    path(path),
+    chunk_size(std::max<size_t>(chunk_size, 4096)),
+    fd(-1),
+    data(nullptr),
+    capacity(0),
+    end(0),
+    next_index_offset(0)
+{
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    if (!grow(sizeof(LogHeader))) {
+        ::close(fd);
+        fd = -1;
+        return;
+    }
+    LogHeader header = {log_magic, log_version};
+    std::memcpy(data, &header, sizeof(header));
+    end = sizeof(header);
+}
+
+bool Recorder::grow(size_t required)
+{
+    size_t new_capacity = (required + chunk_size - 1) / chunk_size * chunk_size;
+    if (ftruncate(fd, new_capacity) != 0) return false;
+    void* memory;
+    if (data) {
+        memory = mremap(data, capacity, new_capacity, MREMAP_MAYMOVE);
+    } else {
+        memory = mmap(nullptr, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (memory == MAP_FAILED) return false;
+    data = static_cast<uint8_t*>(memory);
+    capacity = new_capacity;
+    return true;
+}
+
+uint8_t* Recorder::append(uint32_t channel, size_t size, double time)
+{
+    if (!data || size > UINT32_MAX) return nullptr;
+    size_t record_size = sizeof(RecordHeader) + padded(size);
+    if (end + record_size > capacity && !grow(end + record_size)) return nullptr;
+
+    RecordHeader header = {std::llround(1e9 * time), channel, static_cast<uint32_t>(size)};
+    if (channel != meta_channel && end >= next_index_offset) {
+        index.push_back({header.time, end});
+        next_index_offset = end + index_interval;
+    }
+    std::memcpy(data + end, &header, sizeof(header));
+    uint8_t* result = data + end + sizeof(header);
+    end += record_size;
+    return result;
+}
+
+uint32_t Recorder::add_channel(const std::string& name)
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+    channels.push_back(name);
+    uint32_t channel = channels.size();
+    uint8_t* data = append(meta_channel, sizeof(uint32_t) + name.size(), 0);
+    if (data) {
+        std::memcpy(data, &channel, sizeof(channel));
+        std::memcpy(data + sizeof(channel), name.data(), name.size());
+    }
+    return channel;
+}
+
+size_t Recorder::size() const
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+    return end;
+}
+
+// Disconnecting waits for writes already in progress, so none can reach
+// an input once the destructor frees it
+void Recorder::close()
+{
+    for (auto& input: inputs) {
+        input->detach();
+    }
+    std::scoped_lock<std::mutex> lock(mutex);
+    if (!data) return;
+    munmap(data, capacity);
+    data = nullptr;
+    // If this fails, the zeroed space left at the end reads as the end
+    // of the log anyway
+    if (ftruncate(fd, end) != 0) {}
+    ::close(fd);
+    fd = -1;
+
+    uint64_t header[2] = {index_magic, end};
+    std::vector<uint8_t> buffer(sizeof(header) + serialized_size(index) + serialized_size(channels));
+    std::memcpy(buffer.data(), header, sizeof(header));
+    serialize(channels, serialize(index, buffer.data() + sizeof(header)));
+    std::ofstream file(index_path(path), std::ios::binary);
+    file.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+}
+
+Recorder::~Recorder()
+{
+    close();
+}
+
+Player::Player(Engine& engine, const std::string& path, const PlaybackConfig& config):
+    engine(engine),
+    config(config),
+    path(path),
+    data(nullptr),
+    size(0),
+    pos(0),
+    play_time(std::llround(1e9 * config.start_time)),
+    real_start(0),
+    finished_(false),
+    message_count(0),
+    byte_count(0)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat info;
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(LogHeader)) {
+        memory = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (memory == MAP_FAILED) return;
+
+    LogHeader header;
+    std::memcpy(&header, memory, sizeof(header));
+    if (header.magic != log_magic || header.version != log_version) {
+        munmap(memory, info.st_size);
+        return;
+    }
+    data = static_cast<const uint8_t*>(memory);
+    size = info.st_size;
+    madvise(const_cast<uint8_t*>(data), size, MADV_SEQUENTIAL);
+
+    if (!read_index()) {
+        scan_channels();
+    }
+    seek(play_time);
+
+    engine.set_time_source([this]() { return get_time(); });
+    engine.create_poll_callback([this]() { return poll(); }, "player");
+}
+
+Player::~Player()
+{
+    if (data) {
+        munmap(const_cast<uint8_t*>(data), size);
+    }
+}
+
+#else
+
+Recorder::Recorder(Engine& engine, const std::string& path, size_t chunk_size):
+    engine(engine),
+    path(path),
+    chunk_size(chunk_size),
+    fd(-1),
+    data(nullptr),
+    capacity(0),
+    end(0),
+    next_index_offset(0)
+{}
+
+bool Recorder::grow(size_t)
+{
+    return false;
+}
+
+uint8_t* Recorder::append(uint32_t, size_t, double)
+{
+    return nullptr;
+}
+
+uint32_t Recorder::add_channel(const std::string& name)
+{
+    channels.push_back(name);
+    return channels.size();
+}
+
+size_t Recorder::size() const
+{
+    return 0;
+}
+
+void Recorder::close()
+{
+    for (auto& input: inputs) {
+        input->detach();
+    }
+}
+
+Recorder::~Recorder()
+{
+    close();
+}
+
+Player::Player(Engine& engine, const std::string& path, const PlaybackConfig& config):
+    engine(engine),
+    config(config),
+    path(path),
+    data(nullptr),
+    size(0),
+    pos(0),
+    play_time(0),
+    real_start(0),
+    finished_(true),
+    message_count(0),
+    byte_count(0)
+{}
+
+Player::~Player() {}
+
+#endif
+
+// Reads the index and channel names, if the index was written for a log
+// of this size
+bool Player::read_index()
+{
+    std::ifstream file(index_path(path), std::ios::binary);
+    if (!file) return false;
+    std::vector<uint8_t> buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    uint64_t header[2];
+    if (buffer.size() < sizeof(header)) return false;
+    std::memcpy(header, buffer.data(), sizeof(header));
+    if (header[0] != index_magic || header[1] != size) return false;
+
+    const uint8_t* begin = buffer.data() + sizeof(header);
+    const uint8_t* end = buffer.data() + buffer.size();
+    begin = Serializer<decltype(index)>::read(index, begin, end);
+    if (!begin || Serializer<decltype(channel_names)>::read(channel_names, begin, end) != end) {
+        index.clear();
+        channel_names.clear();
+        return false;
+    }
+    return true;
+}
+
+// Without an index, such as if the recorder didn't close, finds the
+// channel names by reading every record header
+void Player::scan_channels()
+{
+    size_t offset = sizeof(LogHeader);
+    while (offset + sizeof(RecordHeader) <= size) {
+        RecordHeader header;
+        std::memcpy(&header, data + offset, sizeof(header));
+        // As in poll, a truncated record ends the log
+        if (header.channel == 0 || offset + sizeof(header) + header.size > size) break;
+        const uint8_t* message = data + offset + sizeof(header);
+        if (header.channel == meta_channel && header.size >= sizeof(uint32_t)) {
+            uint32_t channel;
+            std::memcpy(&channel, message, sizeof(channel));
+            // Channels are named in the order they were added, so any other
+            // id means the log is corrupt
+            if (channel == 0 || channel > channel_names.size() + 1) break;
+            if (channel_names.size() < channel) channel_names.resize(channel);
+            channel_names[channel - 1].assign(
+                reinterpret_cast<const char*>(message + sizeof(channel)),
+                header.size - sizeof(channel));
+        }
+        offset += sizeof(header) + padded(header.size);
+    }
+}
+
+void Player::add_output(const std::string& name, std::unique_ptr<PlayOutputBase>&& output)
+{
+    channel_outputs.resize(channel_names.size() + 1);
+    for (size_t i = 0; i < channel_names.size(); i++) {
+        if (channel_names[i] == name) {
+            channel_outputs[i + 1].push_back(output.get());
+        }
+    }
+    outputs.push_back(std::move(output));
+}
+
+// Starts from the last indexed record before the time
+void Player::seek(int64_t time)
+{
+    pos = sizeof(LogHeader);
+    auto iter = std::upper_bound(index.begin(), index.end(), time, [](int64_t time, const RecordingIndexEntry& entry) {
+        return time < entry.time;
+    });
+    if (iter != index.begin()) {
+        pos = std::prev(iter)->offset;
+    }
+}
+
+bool Player::poll()
+{
+    if (real_start == 0) {
+        real_start = monotonic_ns();
+    }
+    int64_t start_time = std::llround(1e9 * config.start_time);
+
+    size_t i = 0;
+    for (; i < play_batch; i++) {
+        RecordHeader header;
+        if (pos + sizeof(header) > size) break;
+        std::memcpy(&header, data + pos, sizeof(header));
+        size_t record_size = sizeof(header) + padded(header.size);
+        if (header.channel == 0 || pos + record_size > size) break;
+
+        if (header.channel == meta_channel || header.time < start_time) {
+            pos += record_size;
+            continue;
+        }
+        if (config.rate > 0) {
+            int64_t now = get_time().timestamp;
+            if (header.time > now) {
+                double wait = 1e-9 * static_cast<double>(header.time - now) / config.rate;
+                std::this_thread::sleep_for(std::chrono::duration<double>(std::min(wait, max_play_wait)));
+                return true;
+            }
+        }
+        // The engine time reaches the message's time before it's written
+        if (header.time != play_time) {
+            play_time = header.time;
+            engine.update_time_source();
+        }
+        if (header.channel < channel_outputs.size()) {
+            for (PlayOutputBase* output: channel_outputs[header.channel]) {
+                output->play(data + pos + sizeof(header), header.size);
+            }
+        }
+        pos += record_size;
+        message_count++;
+        byte_count += record_size;
+    }
+    // Skipped records count towards the batch too, so the log only ended
+    // if the loop stopped early
+    if (i == play_batch) return true;
+
+    finished_ = true;
+    if (config.stop_at_end) {
+        engine.stop();
+    }
+    return false;
+}
+
+// While playing in real time (or scaled), time advances at the given rate
+// from the start time. Playing as fast as possible, it is the time of the
+// latest message, and the rate is zero, as in the config, which also saves
+// reading the clock for every message.
+TimePoint Player::get_time() const
+{
+    int64_t time;
+    if (config.rate > 0) {
+        int64_t start = real_start;
+        int64_t elapsed = start == 0 ? 0 : monotonic_ns() - start;
+        time = std::llround(1e9 * config.start_time + config.rate * elapsed);
+    } else {
+        time = play_time;
+    }
+    TimePoint result;
+    result.time = 1e-9 * static_cast<double>(time);
+    result.timestamp = time;
+    result.rate = config.rate;
+    return result;
+}
+
+} // namespace flow
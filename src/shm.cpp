@@ -0,0 +1,254 @@
+#include "flow/shm.h"
+#include <cstring>
+#include <new>
+#ifdef __linux__
+#include <climits>
+#include <cmath>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+
+namespace flow {
+
+// Set once the creator has initialised the ring, so a process opening it
+// while it is being created doesn't use it early
+static constexpr uint64_t shm_magic = 0x666c6f7772696e67;
+// Offset of a message within its slot, after the sequence number
+static constexpr size_t shm_data_offset = 16;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory atomics must be lock-free");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "Shared memory atomics must be lock-free");
+
+struct ShmRing::Header {
+    std::atomic<uint64_t> magic;
+    uint64_t capacity;
+    uint64_t message_size;
+    uint64_t slot_size;
+    alignas(64) std::atomic<uint64_t> enqueue_pos;
+    alignas(64) std::atomic<uint64_t> dequeue_pos;
+    // Incremented on each push while a reader is waiting, which it
+    // waits on as a futex
+    alignas(64) std::atomic<uint32_t> wakeup;
+    std::atomic<uint32_t> waiters;
+};
+
+static size_t round_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+size_t ShmRing::slots_offset()
+{
+    return round_up(sizeof(ShmRing::Header), 64);
+}
+
+ShmRing::ShmRing(const std::string& name, void* memory, size_t size, uint64_t inode, bool owner):
+    name(name),
+    memory(memory),
+    size(size),
+    inode(inode),
+    owner(owner),
+    header(static_cast<Header*>(memory))
+{}
+
+void* ShmRing::slot(uint64_t pos) const
+{
+    size_t index = pos & (header->capacity - 1);
+    return static_cast<char*>(memory) + slots_offset() + index * header->slot_size;
+}
+
+static std::atomic<uint64_t>& slot_sequence(void* slot)
+{
+    return *static_cast<std::atomic<uint64_t>*>(slot);
+}
+
+size_t ShmRing::capacity() const
+{
+    return header->capacity;
+}
+
+bool ShmRing::try_push(const void* data)
+{
+    uint64_t pos = header->enqueue_pos.load(std::memory_order_relaxed);
+    void* target;
+    while (true) {
+        target = slot(pos);
+        uint64_t sequence = slot_sequence(target).load(std::memory_order_acquire);
+        auto diff = static_cast<int64_t>(sequence) - static_cast<int64_t>(pos);
+        if (diff == 0) {
+            if (header->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = header->enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    std::memcpy(static_cast<char*>(target) + shm_data_offset, data, header->message_size);
+    slot_sequence(target).store(pos + 1, std::memory_order_release);
+
+    // Pairs with the fence in wait(), so either the reader sees this
+    // message or this sees the reader waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (header->waiters.load(std::memory_order_relaxed) > 0) {
+        header->wakeup.fetch_add(1, std::memory_order_release);
+#ifdef __linux__
+        syscall(SYS_futex, &header->wakeup, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+    }
+    return true;
+}
+
+const void* ShmRing::front()
+{
+    uint64_t pos = header->dequeue_pos.load(std::memory_order_relaxed);
+    void* source = slot(pos);
+    if (slot_sequence(source).load(std::memory_order_acquire) != pos + 1) {
+        return nullptr;
+    }
+    return static_cast<char*>(source) + shm_data_offset;
+}
+
+void ShmRing::pop()
+{
+    uint64_t pos = header->dequeue_pos.load(std::memory_order_relaxed);
+    slot_sequence(slot(pos)).store(pos + header->capacity, std::memory_order_release);
+    header->dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+}
+
+#ifdef __linux__
+
+static std::string shm_path(const std::string& name)
+{
+    return name.empty() || name[0] != '/' ? "/" + name : name;
+}
+
+std::unique_ptr<ShmRing> ShmRing::create(const std::string& name, size_t capacity, size_t message_size)
+{
+    size_t slot_count = 1;
+    while (slot_count < capacity) slot_count <<= 1;
+    size_t slot_size = round_up(shm_data_offset + message_size, 64);
+    size_t size = slots_offset() + slot_count * slot_size;
+
+    std::string path = shm_path(name);
+    shm_unlink(path.c_str());
+    int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return nullptr;
+    struct stat info;
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, size) == 0 && fstat(fd, &info) == 0) {
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED) {
+        shm_unlink(path.c_str());
+        return nullptr;
+    }
+
+    // The memory is zeroed, so magic stays unset until initialised
+    Header* header = new (memory) Header();
+    header->capacity = slot_count;
+    header->message_size = message_size;
+    header->slot_size = slot_size;
+    auto ring = std::unique_ptr<ShmRing>(new ShmRing(path, memory, size, info.st_ino, true));
+    for (size_t i = 0; i < slot_count; i++) {
+        new (ring->slot(i)) std::atomic<uint64_t>(i);
+    }
+    header->magic.store(shm_magic, std::memory_order_release);
+    return ring;
+}
+
+std::unique_ptr<ShmRing> ShmRing::open(const std::string& name, size_t message_size)
+{
+    std::string path = shm_path(name);
+    int fd = shm_open(path.c_str(), O_RDWR, 0);
+    if (fd < 0) return nullptr;
+    struct stat info;
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && size_t(info.st_size) >= slots_offset()) {
+        memory = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED) return nullptr;
+
+    auto ring = std::unique_ptr<ShmRing>(new ShmRing(path, memory, info.st_size, info.st_ino, false));
+    const Header* header = ring->header;
+    if (header->magic.load(std::memory_order_acquire) != shm_magic
+        || header->message_size != message_size
+        || slots_offset() + header->capacity * header->slot_size > size_t(info.st_size))
+    {
+        return nullptr;
+    }
+    return ring;
+}
+
+ShmRing::~ShmRing()
+{
+    munmap(memory, size);
+    // Unless another process has since replaced the ring
+    if (owner && !stale()) {
+        shm_unlink(name.c_str());
+    }
+}
+
+bool ShmRing::wait(double timeout)
+{
+    uint32_t seen = header->wakeup.load(std::memory_order_acquire);
+    header->waiters.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!front()) {
+        timespec duration;
+        duration.tv_sec = static_cast<time_t>(timeout);
+        duration.tv_nsec = static_cast<long>(1e9 * (timeout - std::floor(timeout)));
+        // Returns straight away if a push has incremented wakeup since
+        // it was read
+        syscall(SYS_futex, &header->wakeup, FUTEX_WAIT, seen, &duration, nullptr, 0);
+    }
+    header->waiters.fetch_sub(1, std::memory_order_relaxed);
+    return front() != nullptr;
+}
+
+bool ShmRing::stale() const
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) return true;
+    struct stat info;
+    bool replaced = fstat(fd, &info) != 0 || uint64_t(info.st_ino) != inode;
+    close(fd);
+    return replaced;
+}
+
+#else
+
+std::unique_ptr<ShmRing> ShmRing::create(const std::string&, size_t, size_t)
+{
+    return nullptr;
+}
+
+std::unique_ptr<ShmRing> ShmRing::open(const std::string&, size_t)
+{
+    return nullptr;
+}
+
+ShmRing::~ShmRing() {}
+
+bool ShmRing::wait(double)
+{
+    return front() != nullptr;
+}
+
+bool ShmRing::stale() const
+{
+    return true;
+}
+
+#endif
+
+} // namespace flow
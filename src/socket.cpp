@@ -0,0 +1,399 @@
+#include "flow/socket.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#ifdef __linux__
+#include <climits>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+
+namespace flow {
+
+// How long the poll callback waits for data or a connection before
+// checking whether the engine has stopped
+static constexpr int socket_poll_ms = 10;
+// Buffers kept for reuse, beyond which released buffers are freed
+static constexpr size_t max_free_buffers = 1024;
+// Buffers waiting to be sent, beyond which messages are dropped, so
+// a stalled peer doesn't grow the queue without limit
+static constexpr size_t max_queued_buffers = 4096;
+// Batches a sending thread writes before returning, leaving the rest to
+// the next sender or the poll callback
+static constexpr size_t max_send_batches = 4;
+
+SocketBridge::SocketBridge(Engine& engine, const std::string& address, SocketRole role, const std::string& name):
+    address(address),
+    role(role),
+    listen_fd(-1),
+    fd(-1),
+    fd_connected(false),
+    sending(false),
+    receive_buffer(1 << 16),
+    receive_size(0),
+    dropped_count(0),
+    sent_count(0),
+    send_call_count(0)
+{
+    engine.create_poll_shutdown_callback(
+        [this]() { return poll(); },
+        [this]() { close_connection(); },
+        name);
+}
+
+SocketBridge::buffer_t SocketBridge::acquire_buffer(uint32_t channel, size_t size)
+{
+    buffer_t buffer;
+    // The header's size field is 32-bit, which would otherwise truncate it
+    if (size > max_message_size) {
+        dropped_count++;
+        return buffer;
+    }
+    {
+        std::scoped_lock<std::mutex> lock(send_mutex);
+        if (!free_buffers.empty()) {
+            buffer = std::move(free_buffers.back());
+            free_buffers.pop_back();
+        }
+    }
+    buffer.resize(header_size + size);
+    uint32_t header[2] = {channel, static_cast<uint32_t>(size)};
+    std::memcpy(buffer.data(), header, header_size);
+    return buffer;
+}
+
+void SocketBridge::release_buffers(std::vector<buffer_t>& buffers)
+{
+    for (auto& buffer: buffers) {
+        if (free_buffers.size() >= max_free_buffers) break;
+        buffer.clear();
+        free_buffers.push_back(std::move(buffer));
+    }
+    buffers.clear();
+}
+
+void SocketBridge::send(buffer_t&& buffer)
+{
+    std::unique_lock<std::mutex> lock(send_mutex);
+    if (fd < 0 || queued.size() >= max_queued_buffers) {
+        dropped_count++;
+        if (free_buffers.size() < max_free_buffers) {
+            buffer.clear();
+            free_buffers.push_back(std::move(buffer));
+        }
+        return;
+    }
+    queued.push_back(std::move(buffer));
+    if (sending) return;
+    write_queued(lock, max_send_batches);
+}
+
+// Writes up to max_batches batches of queued buffers. Must hold send_mutex,
+// which is released while writing.
+void SocketBridge::write_queued(std::unique_lock<std::mutex>& lock, size_t max_batches)
+{
+    sending = true;
+    for (size_t i = 0; i < max_batches && !queued.empty(); i++) {
+        writing.swap(queued);
+        int out = fd;
+        lock.unlock();
+        bool valid = write_buffers(out, writing);
+        lock.lock();
+        if (valid) {
+            sent_count += writing.size();
+        } else {
+            // The poll thread sees the connection close, and reconnects
+            dropped_count += writing.size() + queued.size();
+            release_buffers(queued);
+#ifdef __linux__
+            shutdown(fd, SHUT_RDWR);
+#endif
+        }
+        release_buffers(writing);
+    }
+    sending = false;
+    send_cv.notify_all();
+}
+
+void SocketBridge::add_handler(uint32_t channel, const handler_t& handler)
+{
+    std::scoped_lock<std::mutex> lock(handlers_mutex);
+    auto& current = handlers[channel];
+    auto next = current ? std::make_shared<handlers_t>(*current) : std::make_shared<handlers_t>();
+    next->push_back(handler);
+    current = std::move(next);
+}
+
+bool SocketBridge::poll()
+{
+    if (fd < 0) {
+        open_connection();
+        return true;
+    }
+    flush_queued();
+    if (!receive()) {
+        close_connection();
+    }
+    return true;
+}
+
+#ifdef __linux__
+
+// Fills in the socket address, or returns false if the address is invalid
+static bool parse_address(
+    const std::string& address,
+    sockaddr_storage& storage,
+    socklen_t& length,
+    int& family)
+{
+    std::memset(&storage, 0, sizeof(storage));
+    if (address.rfind("unix:", 0) == 0) {
+        std::string path = address.substr(5);
+        sockaddr_un* unix_address = reinterpret_cast<sockaddr_un*>(&storage);
+        if (path.empty() || path.size() >= sizeof(unix_address->sun_path)) return false;
+        unix_address->sun_family = AF_UNIX;
+        std::memcpy(unix_address->sun_path, path.c_str(), path.size() + 1);
+        length = sizeof(sockaddr_un);
+        family = AF_UNIX;
+        return true;
+    }
+    if (address.rfind("tcp:", 0) == 0) {
+        size_t separator = address.rfind(':');
+        if (separator <= 4) return false;
+        std::string host = address.substr(4, separator - 4);
+        std::string port = address.substr(separator + 1);
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || !result) return false;
+        std::memcpy(&storage, result->ai_addr, result->ai_addrlen);
+        length = result->ai_addrlen;
+        family = result->ai_family;
+        freeaddrinfo(result);
+        return true;
+    }
+    return false;
+}
+
+static void configure_socket(int socket_fd, int family)
+{
+    // Messages are batched before writing, so don't delay them further
+    if (family != AF_UNIX) {
+        int enable = 1;
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+}
+
+bool SocketBridge::open_connection()
+{
+    sockaddr_storage storage;
+    socklen_t length;
+    int family;
+    if (!parse_address(address, storage, length, family)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(socket_poll_ms));
+        return false;
+    }
+    const sockaddr* socket_address = reinterpret_cast<const sockaddr*>(&storage);
+
+    int new_fd = -1;
+    if (role == SocketRole::Listen) {
+        if (listen_fd < 0) {
+            listen_fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listen_fd < 0) return false;
+            if (family == AF_UNIX) {
+                unlink(reinterpret_cast<const sockaddr_un*>(&storage)->sun_path);
+            } else {
+                int enable = 1;
+                setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+            }
+            if (bind(listen_fd, socket_address, length) != 0 || listen(listen_fd, 1) != 0) {
+                close(listen_fd);
+                listen_fd = -1;
+                std::this_thread::sleep_for(std::chrono::milliseconds(socket_poll_ms));
+                return false;
+            }
+        }
+        pollfd request = {listen_fd, POLLIN, 0};
+        if (::poll(&request, 1, socket_poll_ms) <= 0) return false;
+        new_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    } else {
+        new_fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (new_fd >= 0 && connect(new_fd, socket_address, length) != 0) {
+            close(new_fd);
+            new_fd = -1;
+        }
+        if (new_fd < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(socket_poll_ms));
+        }
+    }
+    if (new_fd < 0) return false;
+
+    configure_socket(new_fd, family);
+    std::scoped_lock<std::mutex> lock(send_mutex);
+    fd = new_fd;
+    fd_connected = true;
+    receive_size = 0;
+    return true;
+}
+
+void SocketBridge::close_connection()
+{
+    std::unique_lock<std::mutex> lock(send_mutex);
+    // A sending thread may still be using the fd
+    send_cv.wait(lock, [&]{ return !sending; });
+    // Buffers left for the poll callback to flush are meant for this
+    // connection
+    dropped_count += queued.size();
+    release_buffers(queued);
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    fd_connected = false;
+}
+
+SocketBridge::~SocketBridge()
+{
+    close_connection();
+    if (listen_fd >= 0) {
+        close(listen_fd);
+    }
+}
+
+bool SocketBridge::write_buffers(int out, std::vector<buffer_t>& buffers)
+{
+    // Only one thread sends at a time, but keeping this per thread means
+    // it needs no lock, and stops allocating once grown
+    thread_local std::vector<iovec> iovecs;
+    iovecs.resize(buffers.size());
+    for (size_t i = 0; i < buffers.size(); i++) {
+        iovecs[i].iov_base = buffers[i].data();
+        iovecs[i].iov_len = buffers[i].size();
+    }
+
+    size_t begin = 0;
+    while (begin < iovecs.size()) {
+        msghdr message = {};
+        message.msg_iov = &iovecs[begin];
+        message.msg_iovlen = std::min<size_t>(iovecs.size() - begin, IOV_MAX);
+        ssize_t written = sendmsg(out, &message, MSG_NOSIGNAL);
+        send_call_count++;
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        // Skip past what was written, which may end part way through
+        // a buffer
+        size_t remaining = written;
+        while (begin < iovecs.size() && remaining >= iovecs[begin].iov_len) {
+            remaining -= iovecs[begin].iov_len;
+            begin++;
+        }
+        if (remaining > 0) {
+            iovecs[begin].iov_base = static_cast<uint8_t*>(iovecs[begin].iov_base) + remaining;
+            iovecs[begin].iov_len -= remaining;
+        }
+    }
+    return true;
+}
+
+// Sends buffers left queued by a sender which reached max_send_batches,
+// if no other thread is sending them. Only writes one batch, and only if
+// the socket has room, so the poll thread doesn't stop receiving for long.
+void SocketBridge::flush_queued()
+{
+    std::unique_lock<std::mutex> lock(send_mutex);
+    if (sending || queued.empty() || fd < 0) return;
+    pollfd request = {fd, POLLOUT, 0};
+    if (::poll(&request, 1, 0) <= 0 || !(request.revents & POLLOUT)) return;
+    write_queued(lock, 1);
+}
+
+// Reads whatever has arrived and passes on each complete message.
+// Returns false once the connection is closed.
+bool SocketBridge::receive()
+{
+    pollfd request = {fd, POLLIN, 0};
+    int ready = ::poll(&request, 1, socket_poll_ms);
+    if (ready == 0 || (ready < 0 && errno == EINTR)) return true;
+    if (ready < 0) return false;
+
+    ssize_t count = read(fd, receive_buffer.data() + receive_size, receive_buffer.size() - receive_size);
+    if (count < 0 && errno == EINTR) return true;
+    if (count <= 0) return false;
+    receive_size += count;
+
+    size_t pos = 0;
+    while (receive_size - pos >= header_size) {
+        uint32_t header[2];
+        std::memcpy(header, receive_buffer.data() + pos, header_size);
+        if (header[1] > max_message_size) return false;
+        size_t frame_size = header_size + header[1];
+        if (receive_size - pos < frame_size) {
+            // Make room for the rest of a large message
+            if (frame_size > receive_buffer.size()) {
+                receive_buffer.resize(frame_size);
+            }
+            break;
+        }
+        // Handlers run on a snapshot, without the lock, so they may add
+        // handlers, and don't hold up other threads adding them
+        std::shared_ptr<const handlers_t> channel_handlers;
+        {
+            std::scoped_lock<std::mutex> lock(handlers_mutex);
+            auto iter = handlers.find(header[0]);
+            if (iter != handlers.end()) {
+                channel_handlers = iter->second;
+            }
+        }
+        if (channel_handlers) {
+            for (const auto& handler: *channel_handlers) {
+                handler(receive_buffer.data() + pos + header_size, header[1]);
+            }
+        }
+        pos += frame_size;
+    }
+    if (pos > 0) {
+        std::memmove(receive_buffer.data(), receive_buffer.data() + pos, receive_size - pos);
+        receive_size -= pos;
+    }
+    return true;
+}
+
+#else
+
+bool SocketBridge::open_connection()
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(socket_poll_ms));
+    return false;
+}
+
+void SocketBridge::close_connection() {}
+
+SocketBridge::~SocketBridge() {}
+
+bool SocketBridge::write_buffers(int, std::vector<buffer_t>&)
+{
+    return false;
+}
+
+void SocketBridge::flush_queued() {}
+
+bool SocketBridge::receive()
+{
+    return false;
+}
+
+#endif
+
+} // namespace flow
@@ -0,0 +1,89 @@
+#include "flow/stats.h"
+#include <algorithm>
+#include <bit>
+
+
+namespace flow {
+
+// Threads are given shards in turn, the first time they record anything
+static std::atomic<size_t> next_shard(0);
+static thread_local size_t current_shard = next_shard++;
+
+size_t Histogram::bucket(uint64_t value) {
+    return std::min<size_t>(std::bit_width(value), num_buckets - 1);
+}
+
+double Histogram::mean() const {
+    if (count == 0) return 0;
+    return static_cast<double>(total) / count;
+}
+
+uint64_t Histogram::percentile(double p) const {
+    if (count == 0) return 0;
+    uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(p * count));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < num_buckets; i++) {
+        seen += buckets[i];
+        if (seen >= target) {
+            if (i == 0) return 0;
+            if (i == num_buckets - 1) return max;
+            return std::min(max, (uint64_t(1) << i) - 1);
+        }
+    }
+    return max;
+}
+
+void Histogram::merge(const Histogram& other) {
+    count += other.count;
+    total += other.total;
+    max = std::max(max, other.max);
+    for (size_t i = 0; i < num_buckets; i++) {
+        buckets[i] += other.buckets[i];
+    }
+}
+
+ShardedHistogram::ShardedHistogram() {
+    for (auto& shard: shards) {
+        shard.count.store(0, std::memory_order_relaxed);
+        shard.total.store(0, std::memory_order_relaxed);
+        shard.max.store(0, std::memory_order_relaxed);
+        for (auto& bucket: shard.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+void ShardedHistogram::record(uint64_t value) {
+    Shard& shard = shards[current_shard % num_shards];
+    shard.count.fetch_add(1, std::memory_order_relaxed);
+    shard.total.fetch_add(value, std::memory_order_relaxed);
+    shard.buckets[Histogram::bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = shard.max.load(std::memory_order_relaxed);
+    while (value > max && !shard.max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+}
+
+// The shards are read without stopping writers, so a snapshot may be
+// slightly inconsistent (eg: count may not equal the sum of the buckets).
+Histogram ShardedHistogram::load() const {
+    Histogram result;
+    for (const auto& shard: shards) {
+        result.count += shard.count.load(std::memory_order_relaxed);
+        result.total += shard.total.load(std::memory_order_relaxed);
+        result.max = std::max(result.max, shard.max.load(std::memory_order_relaxed));
+        for (size_t i = 0; i < Histogram::num_buckets; i++) {
+            result.buckets[i] += shard.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+    return result;
+}
+
+CallbackStats CallbackCounters::load() const {
+    CallbackStats result;
+    result.name = name;
+    result.wait = wait.load();
+    result.execution = execution.load();
+    result.lateness = lateness.load();
+    return result;
+}
+
+} // namespace flow
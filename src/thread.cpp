@@ -0,0 +1,60 @@
+#include "flow/thread.h"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+namespace flow {
+
+#ifdef __linux__
+
+bool configure_thread(
+    std::thread::native_handle_type handle,
+    const ThreadConfig& config,
+    const std::string& name,
+    size_t index)
+{
+    pthread_setname_np(handle, name.substr(0, 15).c_str());
+
+    bool valid = true;
+    if (!config.cpus.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (size_t i = 0; i < config.cpus.size(); i++) {
+            if (config.pin_each && i != index % config.cpus.size()) continue;
+            int cpu = config.cpus[i];
+            if (cpu < 0 || cpu >= CPU_SETSIZE) {
+                valid = false;
+                continue;
+            }
+            CPU_SET(cpu, &cpus);
+        }
+        if (CPU_COUNT(&cpus) == 0 || pthread_setaffinity_np(handle, sizeof(cpus), &cpus) != 0) {
+            valid = false;
+        }
+    }
+    if (config.realtime_priority > 0) {
+        sched_param param = {};
+        param.sched_priority = config.realtime_priority;
+        if (pthread_setschedparam(handle, SCHED_FIFO, &param) != 0) {
+            valid = false;
+        }
+    }
+    return valid;
+}
+
+#else
+
+bool configure_thread(
+    std::thread::native_handle_type,
+    const ThreadConfig& config,
+    const std::string&,
+    size_t)
+{
+    return config.cpus.empty() && config.realtime_priority <= 0;
+}
+
+#endif
+
+} // namespace flow
@@ -7,13 +7,10 @@ int64_t TimePoint::now_timestamp() {
     return std::chrono::system_clock::now().time_since_epoch().count();
 }
 
-TimePoint TimePoint::now(int64_t initial_timestamp) {
-    TimePoint result;
-    result.timestamp = now_timestamp();
-    result.time = 1e-9 * static_cast<double>(result.timestamp - initial_timestamp);
-    result.rate = 1;
-    return result;
-};
+int64_t monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 Duration operator-(const TimePoint& lhs, const TimePoint& rhs) {
     Duration duration;
@@ -0,0 +1,151 @@
+#include "flow/trace.h"
+#include <algorithm>
+#include <unordered_set>
+
+
+namespace flow {
+
+thread_local Tracer* Tracer::current_tracer = nullptr;
+thread_local Tracer::Buffer* Tracer::current_buffer = nullptr;
+thread_local const char* Tracer::current_flow_source = nullptr;
+
+// Names are never removed, so their pointers stay valid
+const char* intern_trace_name(const std::string& name) {
+    static std::mutex mutex;
+    static std::unordered_set<std::string> names;
+    std::scoped_lock<std::mutex> lock(mutex);
+    return names.insert(name).first->c_str();
+}
+
+Tracer::Buffer::Buffer(size_t size, const std::string& thread_name):
+    thread_name(thread_name),
+    next(0)
+{
+    size_t capacity = 1;
+    while (capacity < size) capacity <<= 1;
+    mask = capacity - 1;
+    events = std::make_unique<Event[]>(capacity);
+}
+
+void Tracer::Buffer::record(EventType type, const char* name, int64_t start, int64_t end, uint64_t flow) {
+    // Only the owning thread records, so next doesn't need a read-modify-write
+    size_t pos = next.load(std::memory_order_relaxed);
+    // Pairs with the reader's acquire fence: a reader that sees any of the
+    // stores below also sees next at pos, so skips the slot it overwrites
+    std::atomic_thread_fence(std::memory_order_release);
+    Event& event = events[pos & mask];
+    event.type.store(type, std::memory_order_relaxed);
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(start, std::memory_order_relaxed);
+    event.end.store(end, std::memory_order_relaxed);
+    event.flow.store(flow, std::memory_order_relaxed);
+    next.store(pos + 1, std::memory_order_release);
+}
+
+Tracer::Tracer(size_t buffer_size):
+    buffer_size(buffer_size),
+    initial_time(monotonic_ns()),
+    next_flow(1)
+{}
+
+void Tracer::attach(const std::string& thread_name) {
+    std::scoped_lock<std::mutex> lock(buffers_mutex);
+    buffers.push_back(std::make_unique<Buffer>(buffer_size, thread_name));
+    current_buffer = buffers.back().get();
+    current_tracer = this;
+}
+
+void Tracer::detach() {
+    current_tracer = nullptr;
+    current_buffer = nullptr;
+}
+
+void Tracer::record_slice(const char* name, int64_t start, int64_t end) {
+    current_buffer->record(EventType::Slice, name, start, end, 0);
+}
+
+uint64_t Tracer::record_flow_start() {
+    uint64_t flow = next_flow.fetch_add(1, std::memory_order_relaxed);
+    int64_t time = monotonic_ns();
+    current_buffer->record(EventType::FlowStart, current_flow_source, time, time, flow);
+    return flow;
+}
+
+void Tracer::record_flow_end(uint64_t flow, int64_t time) {
+    current_buffer->record(EventType::FlowEnd, nullptr, time, time, flow);
+}
+
+static void write_string(std::ostream& os, const char* str) {
+    os << '"';
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') os << '\\';
+        if (static_cast<unsigned char>(*str) < 0x20) continue;
+        os << *str;
+    }
+    os << '"';
+}
+
+void Tracer::write_json(std::ostream& os) const {
+    std::scoped_lock<std::mutex> lock(buffers_mutex);
+    os << "{\"traceEvents\": [\n";
+    bool first = true;
+    auto separator = [&]() {
+        if (!first) os << ",\n";
+        first = false;
+    };
+    auto timestamp = [&](int64_t time) {
+        return 1e-3 * static_cast<double>(time - initial_time);
+    };
+
+    for (size_t tid = 0; tid < buffers.size(); tid++) {
+        const Buffer& buffer = *buffers[tid];
+        separator();
+        os << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": " << tid << ", \"args\": {\"name\": ";
+        write_string(os, buffer.thread_name.c_str());
+        os << "}}";
+
+        size_t capacity = buffer.mask + 1;
+        size_t end = buffer.next.load(std::memory_order_acquire);
+        size_t begin = end > capacity ? end - capacity : 0;
+        for (size_t pos = begin; pos < end; pos++) {
+            const Event& event = buffer.events[pos & buffer.mask];
+            EventType type = event.type.load(std::memory_order_relaxed);
+            const char* name = event.name.load(std::memory_order_relaxed);
+            int64_t start_time = event.start.load(std::memory_order_relaxed);
+            int64_t end_time = event.end.load(std::memory_order_relaxed);
+            uint64_t flow = event.flow.load(std::memory_order_relaxed);
+
+            // Skip the event if the owning thread has since started to
+            // overwrite it, which it does once next reaches pos + capacity
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (buffer.next.load(std::memory_order_relaxed) - pos >= capacity) continue;
+
+            separator();
+            switch (type) {
+            case EventType::Slice:
+                os << "{\"ph\": \"X\", \"name\": ";
+                write_string(os, name);
+                os << ", \"ts\": " << timestamp(start_time)
+                    << ", \"dur\": " << timestamp(end_time) - timestamp(start_time);
+                break;
+            case EventType::FlowStart:
+                os << "{\"ph\": \"s\", \"name\": \"flow\", \"cat\": \"flow\", \"id\": " << flow
+                    << ", \"ts\": " << timestamp(start_time);
+                if (name) {
+                    os << ", \"args\": {\"source\": ";
+                    write_string(os, name);
+                    os << "}";
+                }
+                break;
+            case EventType::FlowEnd:
+                os << "{\"ph\": \"f\", \"bp\": \"e\", \"name\": \"flow\", \"cat\": \"flow\", \"id\": " << flow
+                    << ", \"ts\": " << timestamp(start_time);
+                break;
+            }
+            os << ", \"pid\": 1, \"tid\": " << tid << "}";
+        }
+    }
+    os << "\n]}\n";
+}
+
+} // namespace flow